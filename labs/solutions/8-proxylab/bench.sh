@@ -0,0 +1,171 @@
+#!/bin/bash
+#
+# bench.sh - Throughput and latency of the proxy under load.  Starts
+#     tiny and, for each scenario, a fresh proxy on local ports, drives
+#     them with loadgen and prints one line per scenario.  The report is
+#     also saved as tab-separated values; given the report of an earlier
+#     run, the changes against it are printed too.
+#
+#     usage: ./bench.sh [-d seconds] [-r open loop rate] [-t threads]
+#                       [-a "extra proxy args"] [-o report] [-c old report]
+#
+
+SECONDS_PER_RUN=5
+RATE=2000
+THREADS=8
+PROXY_ARGS=""
+REPORT="bench.tsv"
+BASELINE=""
+PORT_START=20000
+MAX_RAND=20000
+
+# Scenarios: name, proxy engine, loadgen arguments.  "direct" skips the
+# proxy to give tiny's own numbers.
+SCENARIOS="direct|-|-k
+           thread-closed|thread|-k
+           epoll-closed|epoll|-k
+           thread-open|thread|-k -m open -r RATE
+           epoll-open|epoll|-k -m open -r RATE
+           thread-uniform|thread|-k -z 0
+           thread-close|thread|
+           epoll-close|epoll|
+           thread-tunnel|thread|-T
+           epoll-tunnel|epoll|-T"
+
+#####
+# Helper functions
+#
+
+#
+# port_in_use - whether something listens on the local TCP port $1
+#
+function port_in_use {
+    (echo > /dev/tcp/127.0.0.1/$1) 2> /dev/null
+}
+
+#
+# free_port - an unused TCP port, other than $1
+#
+function free_port {
+    port=$(( (RANDOM % MAX_RAND) + PORT_START ))
+    while port_in_use ${port} || [ "${port}" == "$1" ]
+    do
+        port=$(( port + 1 ))
+    done
+    echo ${port}
+}
+
+#
+# wait_for_port - spins until the TCP port $1 is listened on, 5 seconds
+#     at most
+#
+function wait_for_port {
+    for i in $(seq 50)
+    do
+        port_in_use $1 && return 0
+        sleep 0.1
+    done
+    echo "Error: nothing listens on port $1"
+    return 1
+}
+
+#
+# stop - kill the processes given, if any, and wait for them
+#
+function stop {
+    [ $# -gt 0 ] || return 0
+    kill "$@" 2> /dev/null
+    wait "$@" 2> /dev/null
+}
+
+#######
+# Main
+#######
+
+while getopts "d:r:t:a:o:c:" opt
+do
+    case ${opt} in
+        d) SECONDS_PER_RUN=${OPTARG} ;;
+        r) RATE=${OPTARG} ;;
+        t) THREADS=${OPTARG} ;;
+        a) PROXY_ARGS=${OPTARG} ;;
+        o) REPORT=${OPTARG} ;;
+        c) BASELINE=${OPTARG} ;;
+        *) grep "^#     usage" -A1 $0 | cut -c2-; exit 1 ;;
+    esac
+done
+
+if [ -n "${BASELINE}" ] && [ ! -r "${BASELINE}" ]
+then
+    echo "Error: ${BASELINE} not found."
+    exit 1
+fi
+
+# tiny without -Werror: newer compilers warn about tiny.c itself
+make -s proxy loadgen || exit 1
+if [ ! -x ./tiny/tiny ]
+then
+    (cd ./tiny; make -s CFLAGS="-O2 -Wall -I ." tiny) || exit 1
+fi
+
+tiny_port=$(free_port)
+proxy_port=$(free_port ${tiny_port})
+(cd ./tiny; exec ./tiny ${tiny_port} > /dev/null 2>&1) &
+tiny_pid=$!
+proxy_pid=""
+trap 'stop ${proxy_pid} ${tiny_pid}; exit 1' INT TERM
+wait_for_port ${tiny_port} || exit 1
+
+{
+    echo "# $(date '+%F %T') $(git rev-parse --short HEAD 2> /dev/null)" \
+         "$(nproc) cpus, ${THREADS} connections, ${SECONDS_PER_RUN} s," \
+         "proxy args: ${PROXY_ARGS:-none}"
+    echo -e "scenario\treq/s\tMB/s\tp50_us\tp90_us\tp99_us\tp999_us\tmax_us\terrors"
+} > ${REPORT}
+
+# Not in a pipe: the trap must see the proxy_pid of the loop
+while IFS='|' read name engine args
+do
+    name=$(echo ${name})
+    args=${args//RATE/${RATE}}
+    target="localhost:${tiny_port}"
+    proxy_pid=""
+    if [ "${engine}" != "-" ]
+    then
+        ./proxy ${proxy_port} -e ${engine} ${PROXY_ARGS} \
+            < /dev/null > /dev/null 2>&1 &
+        proxy_pid=$!
+        wait_for_port ${proxy_port} || { stop ${proxy_pid}; continue; }
+        target="${target} localhost:${proxy_port}"
+    fi
+    line=$(./loadgen -q -t ${THREADS} -d ${SECONDS_PER_RUN} ${args} ${target} \
+           < /dev/null)
+    stop ${proxy_pid}
+    echo -e "${name}\t${line}" >> ${REPORT}
+done <<< "${SCENARIOS}"
+stop ${tiny_pid}
+
+# The report, and the relative changes of throughput and p99 latency
+awk -F'\t' -v base="${BASELINE}" '
+    BEGIN {
+        if (base != "")
+            while ((getline line < base) > 0)
+            {
+                if (line ~ /^#/)
+                    continue
+                split(line, f, "\t")
+                rps[f[1]] = f[2]
+                p99[f[1]] = f[6]
+            }
+    }
+    /^#/ { print; next }
+    {
+        printf "%-15s %10s %8s %7s %7s %8s %8s %8s %6s", $1, $2, $3, $4,
+               $5, $6, $7, $8, $9
+        if ($1 == "scenario" && base != "")
+            printf "  %8s %8s", "req/s", "p99"
+        else if (($1 in rps) && rps[$1] > 0 && p99[$1] > 0)
+            printf "  %+7.1f%% %+7.1f%%", 100 * ($2 - rps[$1]) / rps[$1],
+                   100 * ($6 - p99[$1]) / p99[$1]
+        printf "\n"
+    }' ${REPORT}
@@ -0,0 +1,814 @@
+/*
+ * cache.c - web object cache of the proxy
+ *
+ * The cache is split into independent shards, and the hash of a url
+ * selects its shard.  Each shard owns its objects, a byte budget of
+ * MAX_CACHE_SIZE / nshards, a chained hash index and its own eviction
+ * queues, and is guarded by its own reader-writer lock, so requests for
+ * urls in different shards never contend.
+ *
+ * Every object is one allocation sized to fit: the block header, the
+ * object bytes and the url.  The budget is charged with the whole
+ * allocation, so the number of objects is bounded by bytes only.  The
+ * bucket array of a shard doubles whenever it holds more objects than
+ * buckets.
+ *
+ * Objects are immutable and reference counted.  A hit hands out a
+ * reference instead of a copy, and eviction only drops the reference of
+ * the cache, so a block is freed by whoever releases it last and never
+ * while a reader is still sending it.
+ *
+ * The eviction policy is chosen at startup:
+ *   lru    strict LRU; a hit moves the block to the front of the queue
+ *          under a per-shard mutex
+ *   clock  CLOCK; a hit only sets the block's referenced bit, the hand
+ *          gives referenced blocks a second chance
+ *   slru   segmented LRU; a hit only sets the referenced bit, eviction
+ *          promotes referenced blocks from the probation queue to the
+ *          protected queue, which holds at most SLRU_PROTECTED of the
+ *          budget
+ *   gdsf   GreedyDual-Size-Frequency; blocks sit in a min-heap keyed by
+ *          L + frequency / size, where L is the key of the last victim,
+ *          so small objects asked for often stay longest and everything
+ *          ages as L rises
+ * Hits of clock, slru and gdsf take no lock beyond the shard's read lock.
+ * A gdsf hit only counts the block's frequency; its key is brought up to
+ * date when it reaches the top of the heap, so a stale block is pushed
+ * down instead of evicted.  lru, clock and slru find a victim in amortized
+ * O(1), gdsf in O(log n).
+ *
+ * With the tinylfu admission policy, every lookup is counted in a
+ * frequency sketch of its shard (see sketch.c), and a new object that
+ * needs room only gets in if it was asked for more often than the block
+ * the eviction policy would evict first; otherwise that block stays and
+ * the object is not cached.  A scan of urls asked for once thus no longer
+ * flushes the objects asked for over and over.  The policy only peeks at
+ * that block: a rejected object leaves its referenced bits, queues and
+ * keys as they were.  Both lookups and the admission decisions are
+ * counted, see cache_stats(); an object stored without a decision, into
+ * a shard with room or in place of an older copy, counts as inserted.
+ *
+ * Every object is fresh until its expires time.  A lookup hands out
+ * stale objects too, for the caller to revalidate with the end server:
+ * if it is still current, cache_refresh() makes it fresh again in place,
+ * otherwise cache_write() of the new response replaces it.
+ *
+ * After a warm restart, a miss first looks for the url in the snapshot
+ * the previous proxy left behind (see snapshot.c).
+ *
+ * Time spent waiting for a busy shard lock on the request path is
+ * reported to the statistics (see stats.c); a lock that is free costs
+ * nothing more than taking it.
+ */
+#include "csapp.h"
+#include "proxy.h"
+#include "cache.h"
+#include "sketch.h"
+#include "snapshot.h"
+#include "stats.h"
+
+/* Initial number of hash buckets of a shard, a power of two */
+#define SHARD_BUCKETS 64
+
+/* Share of a shard's budget the slru protected queue may use, in % */
+#define SLRU_PROTECTED 80
+
+/* Initial room of a gdsf heap */
+#define GDSF_HEAP 64
+
+/* Counters per sketch row, for all shards together */
+#define SKETCH_WIDTH 8192
+
+/* Bytes charged to the budget for an object */
+#define BLOCK_BYTES(size, urllen) \
+    (sizeof(cache_block) + (size) + (urllen) + 1)
+
+/* link is the first member of cache_block */
+#define BLOCK_OF(l) ((cache_block *)(l))
+
+typedef struct
+{
+    pthread_rwlock_t lock;      /* readers share, cache_write() excludes */
+    cache_block **buckets;      /* chains of the hash index */
+    int nbuckets;
+    long totalcachesize;
+    int totalcachenum;
+    long maxcachesize;          /* byte budget of this shard */
+    cache_link queue[2];        /* eviction queues (sentinels) */
+    long queuesize[2];          /* bytes on each queue */
+    cache_link *hand;           /* clock: next block to look at */
+    cache_block **heap;         /* gdsf: blocks by priority, least first */
+    int heapsize, heapcap;
+    double inflation;           /* gdsf: priority of the last victim */
+    sem_t lru_mutex;            /* lru: protection for queue order on hits */
+    sketch freq;                /* tinylfu: recent lookups */
+    long hits, misses;          /* counted with relaxed atomics */
+    long stale, revalidated;
+    long hit_bytes;
+    long inserted, admitted, rejected;  /* under the write lock */
+    long evicted;
+} cache_shard;
+
+/*
+ * An eviction policy.  insert, remove and victim run with the shard
+ * locked for writing, hit runs with the shard locked for reading.  peek
+ * tells which block victim would most likely pick, changing nothing; it
+ * needs the shard locked for writing too, as the state it reads moves.
+ */
+typedef struct
+{
+    char *name;
+    void (*insert)(cache_shard *sp, cache_block *bp);
+    void (*remove)(cache_shard *sp, cache_block *bp);
+    void (*hit)(cache_shard *sp, cache_block *bp);
+    cache_block *(*victim)(cache_shard *sp);
+    cache_block *(*peek)(cache_shard *sp);
+} cache_policy;
+
+static void lru_insert(cache_shard *sp, cache_block *bp);
+static void lru_hit(cache_shard *sp, cache_block *bp);
+static cache_block *lru_victim(cache_shard *sp);
+static void clock_insert(cache_shard *sp, cache_block *bp);
+static void clock_remove(cache_shard *sp, cache_block *bp);
+static cache_block *clock_victim(cache_shard *sp);
+static cache_block *clock_peek(cache_shard *sp);
+static void slru_insert(cache_shard *sp, cache_block *bp);
+static cache_block *slru_victim(cache_shard *sp);
+static cache_block *slru_peek(cache_shard *sp);
+static void gdsf_insert(cache_shard *sp, cache_block *bp);
+static void gdsf_remove(cache_shard *sp, cache_block *bp);
+static void gdsf_hit(cache_shard *sp, cache_block *bp);
+static cache_block *gdsf_victim(cache_shard *sp);
+static cache_block *gdsf_peek(cache_shard *sp);
+static void mark_referenced(cache_shard *sp, cache_block *bp);
+static void shard_rdlock(cache_shard *sp);
+static void shard_wrlock(cache_shard *sp);
+static void queue_remove(cache_shard *sp, cache_block *bp);
+
+static cache_policy policies[] = {
+    {"lru", lru_insert, queue_remove, lru_hit, lru_victim, lru_victim},
+    {"clock", clock_insert, clock_remove, mark_referenced, clock_victim,
+     clock_peek},
+    {"slru", slru_insert, queue_remove, mark_referenced, slru_victim,
+     slru_peek},
+    {"gdsf", gdsf_insert, gdsf_remove, gdsf_hit, gdsf_victim, gdsf_peek},
+};
+
+static cache_shard *shards;
+static int nshards;
+static cache_policy *policy;
+static int tinylfu;             /* admission policy is tinylfu, not all */
+static long miss_bytes;         /* see cache_missed() */
+
+static cache_shard *shard_of(unsigned int hash);
+static cache_block *cache_find(cache_shard *sp, char *url, unsigned int hash);
+static cache_block *cache_lookup(cache_shard *sp, char *url,
+                                 unsigned int hash);
+static void cache_evict(cache_shard *sp, cache_block *victim);
+static void index_insert(cache_shard *sp, cache_block *bp);
+static void index_remove(cache_shard *sp, cache_block *bp);
+static void index_grow(cache_shard *sp);
+
+/*
+ * init cache with n shards, the named eviction and admission policies,
+ * return -1 if there is no such policy
+ */
+int cache_init(int n, char *policy_name, char *admission)
+{
+    policy = NULL;
+    for (int i = 0; i < sizeof(policies) / sizeof(policies[0]); ++i)
+    {
+        if (!strcmp(policy_name, policies[i].name))
+            policy = &policies[i];
+    }
+    if (!policy)
+        return -1;
+    if (!strcmp(admission, "tinylfu"))
+        tinylfu = 1;
+    else if (strcmp(admission, "all"))
+        return -1;
+
+    nshards = n;
+    shards = Calloc(nshards, sizeof(cache_shard));
+    for (int s = 0; s < nshards; ++s)
+    {
+        cache_shard *sp = &shards[s];
+        int rc = pthread_rwlock_init(&sp->lock, NULL);
+        if (rc)
+            posix_error(rc, "pthread_rwlock_init error");
+        sp->nbuckets = SHARD_BUCKETS;
+        sp->buckets = Calloc(sp->nbuckets, sizeof(cache_block *));
+        sp->maxcachesize = MAX_CACHE_SIZE / nshards;
+        for (int q = 0; q < 2; ++q)
+            sp->queue[q].prev = sp->queue[q].next = &sp->queue[q];
+        sp->hand = &sp->queue[0];
+        Sem_init(&sp->lru_mutex, 0, 1);
+        if (tinylfu)
+            sketch_init(&sp->freq, SKETCH_WIDTH / nshards);
+    }
+    return 0;
+}
+
+/* FNV-1a hash of url */
+unsigned int cache_hash(const char *url)
+{
+    unsigned int h = 2166136261u;
+    for (; *url; ++url)
+    {
+        h ^= (unsigned char)*url;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* The high bits pick the shard, the low bits pick the bucket */
+static cache_shard *shard_of(unsigned int hash)
+{
+    return &shards[(hash >> 16) % nshards];
+}
+
+/* Link block bp (with its hash set) into its bucket */
+static void index_insert(cache_shard *sp, cache_block *bp)
+{
+    cache_block **bucket = &sp->buckets[bp->hash & (sp->nbuckets - 1)];
+    bp->hnext = *bucket;
+    *bucket = bp;
+}
+
+/* Unlink block bp from its bucket */
+static void index_remove(cache_shard *sp, cache_block *bp)
+{
+    cache_block **link = &sp->buckets[bp->hash & (sp->nbuckets - 1)];
+    while (*link != bp)
+        link = &(*link)->hnext;
+    *link = bp->hnext;
+}
+
+/* Double the bucket array of shard sp and rehash its blocks */
+static void index_grow(cache_shard *sp)
+{
+    int nbuckets = sp->nbuckets * 2;
+    cache_block **buckets = calloc(nbuckets, sizeof(cache_block *));
+    if (!buckets)
+        return;                 /* keep the longer chains */
+    for (int i = 0; i < sp->nbuckets; ++i)
+    {
+        cache_block *bp = sp->buckets[i], *next;
+        for (; bp; bp = next)
+        {
+            cache_block **bucket = &buckets[bp->hash & (nbuckets - 1)];
+            next = bp->hnext;
+            bp->hnext = *bucket;
+            *bucket = bp;
+        }
+    }
+    Free(sp->buckets);
+    sp->buckets = buckets;
+    sp->nbuckets = nbuckets;
+}
+
+/* Find cache block with given url in shard sp, return NULL if not found */
+static cache_block *cache_find(cache_shard *sp, char *url, unsigned int hash)
+{
+    dbg_printf("totalcachenum: %d\n", sp->totalcachenum);
+    dbg_printf("find: %s\n", url);
+    cache_block *bp = sp->buckets[hash & (sp->nbuckets - 1)];
+    while (bp && (bp->hash != hash || strcmp(url, bp->cache_url)))
+        bp = bp->hnext;
+    dbg_printf("%p\n", (void *)bp);
+    return bp;
+}
+
+/*
+ * Eviction queues.  Every block is on queue[bp->segment] of its shard,
+ * most recently inserted (or promoted) at the front.
+ */
+static void queue_push(cache_shard *sp, int segment, cache_block *bp)
+{
+    cache_link *q = &sp->queue[segment];
+    bp->segment = segment;
+    bp->link.prev = q;
+    bp->link.next = q->next;
+    q->next->prev = &bp->link;
+    q->next = &bp->link;
+    sp->queuesize[segment] += bp->block_bytes;
+}
+
+static void queue_remove(cache_shard *sp, cache_block *bp)
+{
+    bp->link.prev->next = bp->link.next;
+    bp->link.next->prev = bp->link.prev;
+    sp->queuesize[bp->segment] -= bp->block_bytes;
+}
+
+/* Last block of the queue, NULL if empty */
+static cache_block *queue_tail(cache_shard *sp, int segment)
+{
+    cache_link *q = &sp->queue[segment];
+    return q->prev == q ? NULL : BLOCK_OF(q->prev);
+}
+
+/* Hit of clock and slru: one relaxed store, and only the first time */
+static void mark_referenced(cache_shard *sp, cache_block *bp)
+{
+    if (!__atomic_load_n(&bp->referenced, __ATOMIC_RELAXED))
+        __atomic_store_n(&bp->referenced, 1, __ATOMIC_RELAXED);
+}
+
+/* Take back the referenced bit, return whether it was set */
+static int test_and_clear(cache_block *bp)
+{
+    if (!__atomic_load_n(&bp->referenced, __ATOMIC_RELAXED))
+        return 0;
+    __atomic_store_n(&bp->referenced, 0, __ATOMIC_RELAXED);
+    return 1;
+}
+
+/* lru: queue[0] in recency order */
+static void lru_insert(cache_shard *sp, cache_block *bp)
+{
+    queue_push(sp, 0, bp);
+}
+
+static void lru_hit(cache_shard *sp, cache_block *bp)
+{
+    /* Other readers may reorder the queue at the same time */
+    if (sem_trywait(&sp->lru_mutex) < 0)
+    {
+        long t = stats_now();
+        P(&sp->lru_mutex);
+        stats_lock_wait(stats_now() - t);
+    }
+    queue_remove(sp, bp);
+    queue_push(sp, 0, bp);
+    V(&sp->lru_mutex);
+}
+
+static cache_block *lru_victim(cache_shard *sp)
+{
+    return queue_tail(sp, 0);
+}
+
+/* clock: queue[0] is the ring, new blocks go right behind the hand */
+static void clock_insert(cache_shard *sp, cache_block *bp)
+{
+    cache_link *hand = sp->hand;
+    bp->segment = 0;
+    bp->link.next = hand;
+    bp->link.prev = hand->prev;
+    hand->prev->next = &bp->link;
+    hand->prev = &bp->link;
+    sp->queuesize[0] += bp->block_bytes;
+}
+
+static void clock_remove(cache_shard *sp, cache_block *bp)
+{
+    if (sp->hand == &bp->link)
+        sp->hand = bp->link.next;
+    queue_remove(sp, bp);
+}
+
+static cache_block *clock_victim(cache_shard *sp)
+{
+    cache_link *ring = &sp->queue[0];
+    if (ring->next == ring)
+        return NULL;
+    while (1)
+    {
+        if (sp->hand == ring)
+            sp->hand = ring->next;
+        cache_block *bp = BLOCK_OF(sp->hand);
+        if (!test_and_clear(bp))
+            return bp;
+        sp->hand = sp->hand->next;
+    }
+}
+
+/* The first block from the hand on that is not referenced */
+static cache_block *clock_peek(cache_shard *sp)
+{
+    cache_link *ring = &sp->queue[0], *l = sp->hand;
+
+    if (ring->next == ring)
+        return NULL;
+    do
+    {
+        if (l != ring &&
+            !__atomic_load_n(&BLOCK_OF(l)->referenced, __ATOMIC_RELAXED))
+            return BLOCK_OF(l);
+        l = l->next;
+    } while (l != sp->hand);
+
+    /* All referenced: one turn of the hand clears them, it then stops */
+    return BLOCK_OF(sp->hand == ring ? ring->next : sp->hand);
+}
+
+/* slru: queue[0] is probation, queue[1] is protected */
+static void slru_insert(cache_shard *sp, cache_block *bp)
+{
+    queue_push(sp, 0, bp);
+}
+
+static cache_block *slru_victim(cache_shard *sp)
+{
+    long maxprotected = sp->maxcachesize / 100 * SLRU_PROTECTED;
+    cache_block *bp, *tail;
+
+    while (1)
+    {
+        if ((bp = queue_tail(sp, 0)))
+        {
+            if (!test_and_clear(bp))
+                return bp;
+
+            /* Hit while on probation: promote, demote protected overflow */
+            queue_remove(sp, bp);
+            queue_push(sp, 1, bp);
+            while (sp->queuesize[1] > maxprotected &&
+                   (tail = queue_tail(sp, 1)) != bp)
+            {
+                queue_remove(sp, tail);
+                queue_push(sp, 0, tail);
+            }
+        }
+        else if ((bp = queue_tail(sp, 1)))
+        {
+            if (!test_and_clear(bp))
+                return bp;
+            queue_remove(sp, bp);
+            queue_push(sp, 1, bp);
+        }
+        else
+            return NULL;
+    }
+}
+
+/*
+ * The tail-most block of probation, then of protected, that is not
+ * referenced; referenced ones are moved out of the way by slru_victim
+ */
+static cache_block *slru_peek(cache_shard *sp)
+{
+    for (int segment = 0; segment < 2; ++segment)
+    {
+        cache_link *q = &sp->queue[segment];
+        for (cache_link *l = q->prev; l != q; l = l->prev)
+            if (!__atomic_load_n(&BLOCK_OF(l)->referenced, __ATOMIC_RELAXED))
+                return BLOCK_OF(l);
+    }
+    cache_block *bp = queue_tail(sp, 0);
+    return bp ? bp : queue_tail(sp, 1);
+}
+
+/* gdsf: binary min-heap of the shard's blocks on priority */
+static void heap_set(cache_shard *sp, int i, cache_block *bp)
+{
+    sp->heap[i] = bp;
+    bp->heapidx = i;
+}
+
+static void heap_up(cache_shard *sp, int i)
+{
+    cache_block *bp = sp->heap[i];
+    while (i > 0 && sp->heap[(i - 1) / 2]->priority > bp->priority)
+    {
+        heap_set(sp, i, sp->heap[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    heap_set(sp, i, bp);
+}
+
+static void heap_down(cache_shard *sp, int i)
+{
+    cache_block *bp = sp->heap[i];
+    while (1)
+    {
+        int child = 2 * i + 1;
+        if (child >= sp->heapsize)
+            break;
+        if (child + 1 < sp->heapsize &&
+            sp->heap[child + 1]->priority < sp->heap[child]->priority)
+            child++;
+        if (sp->heap[child]->priority >= bp->priority)
+            break;
+        heap_set(sp, i, sp->heap[child]);
+        i = child;
+    }
+    heap_set(sp, i, bp);
+}
+
+/* Key of bp from its current frequency; the cost of every object is 1 */
+static void gdsf_key(cache_shard *sp, cache_block *bp)
+{
+    bp->keyed = __atomic_load_n(&bp->frequency, __ATOMIC_RELAXED);
+    bp->priority = sp->inflation + (double)bp->keyed / bp->block_bytes;
+}
+
+static void gdsf_insert(cache_shard *sp, cache_block *bp)
+{
+    if (sp->heapsize == sp->heapcap)
+    {
+        sp->heapcap = sp->heapcap ? 2 * sp->heapcap : GDSF_HEAP;
+        sp->heap = Realloc(sp->heap, sp->heapcap * sizeof(cache_block *));
+    }
+    bp->frequency = 1;
+    gdsf_key(sp, bp);
+    heap_set(sp, sp->heapsize++, bp);
+    heap_up(sp, bp->heapidx);
+}
+
+static void gdsf_remove(cache_shard *sp, cache_block *bp)
+{
+    int i = bp->heapidx;
+    cache_block *last = sp->heap[--sp->heapsize];
+
+    if (last == bp)
+        return;
+    heap_set(sp, i, last);
+    heap_up(sp, i);
+    heap_down(sp, last->heapidx);
+}
+
+static void gdsf_hit(cache_shard *sp, cache_block *bp)
+{
+    __atomic_add_fetch(&bp->frequency, 1, __ATOMIC_RELAXED);
+}
+
+/* The least block whose key is up to date, hits rekey and sink the rest */
+static cache_block *gdsf_victim(cache_shard *sp)
+{
+    while (sp->heapsize > 0)
+    {
+        cache_block *bp = sp->heap[0];
+        if (bp->keyed == __atomic_load_n(&bp->frequency, __ATOMIC_RELAXED))
+            return bp;
+        gdsf_key(sp, bp);
+        heap_down(sp, 0);
+    }
+    return NULL;
+}
+
+/*
+ * The top of the heap: keys only grow when brought up to date, so it is
+ * the victim unless a hit since it was keyed sinks it
+ */
+static cache_block *gdsf_peek(cache_shard *sp)
+{
+    return sp->heapsize > 0 ? sp->heap[0] : NULL;
+}
+
+/* Remove victim from shard sp, it is freed once its readers are done */
+static void cache_evict(cache_shard *sp, cache_block *victim)
+{
+    index_remove(sp, victim);
+    policy->remove(sp, victim);
+    sp->totalcachesize -= victim->block_bytes;
+    sp->totalcachenum--;
+    cache_release(victim);
+}
+
+/*
+ * Look up url and return its block with a reference held, the caller
+ * must cache_release it; return NULL if cache miss
+ */
+cache_block *cache_read(char *url)
+{
+    unsigned int hash = cache_hash(url);
+    cache_shard *sp = shard_of(hash);
+    const char *obj;
+    long expires;
+    int size, i;
+
+    if (tinylfu)
+        sketch_add(&sp->freq, hash);
+    cache_block *bp = cache_lookup(sp, url, hash);
+
+    /*
+     * A miss may still be in the snapshot of a warm restart; the entry is
+     * used up only once the cache took it
+     */
+    if (!bp && (i = snapshot_find(url, hash, &obj, &size, &expires)) >= 0 &&
+        cache_write((char *)obj, url, size, expires))
+    {
+        snapshot_take(i);
+        bp = cache_lookup(sp, url, hash);
+    }
+    if (!bp)
+        __atomic_add_fetch(&sp->misses, 1, __ATOMIC_RELAXED);
+    else if (!cache_fresh(bp))
+        __atomic_add_fetch(&sp->stale, 1, __ATOMIC_RELAXED);
+    else
+        __atomic_add_fetch(&sp->hits, 1, __ATOMIC_RELAXED);
+    return bp;
+}
+
+/* Whether bp may be sent without asking the end server */
+int cache_fresh(cache_block *bp)
+{
+    return __atomic_load_n(&bp->expires, __ATOMIC_RELAXED) > time(NULL);
+}
+
+/* The end server confirmed the stale bp: fresh until expires */
+void cache_refresh(cache_block *bp, long expires)
+{
+    cache_shard *sp = shard_of(bp->hash);
+    __atomic_store_n(&bp->expires, expires, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&sp->revalidated, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Count bytes written to a client from bp, a fresh or revalidated hit:
+ * the head and the body or range as sent, inflated if it was
+ */
+void cache_served(cache_block *bp, long bytes)
+{
+    cache_shard *sp = shard_of(bp->hash);
+    __atomic_add_fetch(&sp->hit_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+/* Find url in shard sp and take a reference, NULL if not there */
+static cache_block *cache_lookup(cache_shard *sp, char *url,
+                                 unsigned int hash)
+{
+    shard_rdlock(sp);
+    cache_block *bp = cache_find(sp, url, hash);
+    if (bp)
+    {
+        __atomic_add_fetch(&bp->refcnt, 1, __ATOMIC_RELAXED);
+        policy->hit(sp, bp);
+    }
+    pthread_rwlock_unlock(&sp->lock);
+    return bp;
+}
+
+/* Drop a reference to bp, free it once evicted and unused */
+void cache_release(cache_block *bp)
+{
+    if (__atomic_sub_fetch(&bp->refcnt, 1, __ATOMIC_ACQ_REL) == 0)
+        Free(bp);
+}
+
+/*
+ * Write new cache block, fresh until expires, replacing an older one;
+ * return whether it was stored
+ */
+int cache_write(char *buf, char *url, int size, long expires)
+{
+    unsigned int hash = cache_hash(url);
+    cache_shard *sp = shard_of(hash);
+    size_t urllen = strlen(url);
+    long bytes = BLOCK_BYTES(size, urllen);
+
+    /* Larger than a whole shard, it would evict everything and still miss */
+    if (bytes > sp->maxcachesize)
+        return 0;
+
+    cache_block *bp = malloc(bytes);
+    if (!bp)
+        return 0;
+    memcpy(bp->cache_obj, buf, size);
+    bp->cache_url = bp->cache_obj + size;
+    memcpy(bp->cache_url, url, urllen + 1);
+    bp->object_size = size;
+    bp->block_bytes = bytes;
+    bp->hash = hash;
+    bp->refcnt = 1;
+    bp->referenced = 0;
+    bp->expires = expires;
+
+    shard_wrlock(sp);
+
+    /* A newer response of the same url takes the place of the old one */
+    cache_block *victim = cache_find(sp, url, hash);
+    int replace = victim != NULL;
+    if (replace)
+        cache_evict(sp, victim);
+
+    /* No room: only worth it if asked for more often than the victim */
+    if (!replace && tinylfu &&
+        sp->totalcachesize + bytes > sp->maxcachesize &&
+        (victim = policy->peek(sp)))
+    {
+        if (sketch_estimate(&sp->freq, hash) <=
+            sketch_estimate(&sp->freq, victim->hash))
+        {
+            sp->rejected++;
+            pthread_rwlock_unlock(&sp->lock);
+            Free(bp);
+            return 0;
+        }
+        sp->admitted++;
+    }
+    else
+        sp->inserted++;
+
+    /*
+     * find eviction(s); under gdsf the key of each victim, always the
+     * least, becomes the inflation, and only here: a replaced copy does
+     * not age the other blocks
+     */
+    while (sp->totalcachesize + bytes > sp->maxcachesize &&
+           (victim = policy->victim(sp)))
+    {
+        if (policy->victim == gdsf_victim && victim->priority > sp->inflation)
+            sp->inflation = victim->priority;
+        cache_evict(sp, victim);
+        sp->evicted++;
+    }
+
+    /* update */
+    sp->totalcachesize += bytes;
+    sp->totalcachenum++;
+    if (sp->totalcachenum > sp->nbuckets)
+        index_grow(sp);
+    index_insert(sp, bp);
+    policy->insert(sp, bp);
+
+    pthread_rwlock_unlock(&sp->lock);
+    return 1;
+}
+
+/*
+ * Count bytes served for a lookup that missed: fetched from the end
+ * server, relayed from another request's fetch or read from disk
+ */
+void cache_missed(long bytes)
+{
+    __atomic_add_fetch(&miss_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+/*
+ * Take a reference to every cached block, for a snapshot; return how
+ * many, with the array in *blocks, which the caller frees after releasing
+ * each of them
+ */
+int cache_collect(cache_block ***blocks)
+{
+    int n = 0, max = 0;
+
+    *blocks = NULL;
+    for (int s = 0; s < nshards; ++s)
+    {
+        cache_shard *sp = &shards[s];
+        pthread_rwlock_rdlock(&sp->lock);
+        if (n + sp->totalcachenum > max)
+        {
+            max = n + sp->totalcachenum;
+            *blocks = Realloc(*blocks, max * sizeof(cache_block *));
+        }
+        for (int i = 0; i < sp->nbuckets; ++i)
+        {
+            for (cache_block *bp = sp->buckets[i]; bp; bp = bp->hnext)
+            {
+                __atomic_add_fetch(&bp->refcnt, 1, __ATOMIC_RELAXED);
+                (*blocks)[n++] = bp;
+            }
+        }
+        pthread_rwlock_unlock(&sp->lock);
+    }
+    return n;
+}
+
+/* Sum the counters of all shards into t */
+void cache_stats(cache_totals *t)
+{
+    memset(t, 0, sizeof(cache_totals));
+    t->miss_bytes = __atomic_load_n(&miss_bytes, __ATOMIC_RELAXED);
+    for (int s = 0; s < nshards; ++s)
+    {
+        cache_shard *sp = &shards[s];
+        t->hits += __atomic_load_n(&sp->hits, __ATOMIC_RELAXED);
+        t->misses += __atomic_load_n(&sp->misses, __ATOMIC_RELAXED);
+        t->stale += __atomic_load_n(&sp->stale, __ATOMIC_RELAXED);
+        t->revalidated += __atomic_load_n(&sp->revalidated, __ATOMIC_RELAXED);
+        t->hit_bytes += __atomic_load_n(&sp->hit_bytes, __ATOMIC_RELAXED);
+        pthread_rwlock_rdlock(&sp->lock);
+        t->inserted += sp->inserted;
+        t->admitted += sp->admitted;
+        t->rejected += sp->rejected;
+        t->evicted += sp->evicted;
+        t->objects += sp->totalcachenum;
+        t->bytes += sp->totalcachesize;
+        pthread_rwlock_unlock(&sp->lock);
+    }
+}
+
+/* Lock sp for reading, counting the wait if someone holds it */
+static void shard_rdlock(cache_shard *sp)
+{
+    if (pthread_rwlock_tryrdlock(&sp->lock) == 0)
+        return;
+    long t = stats_now();
+    pthread_rwlock_rdlock(&sp->lock);
+    stats_lock_wait(stats_now() - t);
+}
+
+/* Lock sp for writing, counting the wait if someone holds it */
+static void shard_wrlock(cache_shard *sp)
+{
+    if (pthread_rwlock_trywrlock(&sp->lock) == 0)
+        return;
+    long t = stats_now();
+    pthread_rwlock_wrlock(&sp->lock);
+    stats_lock_wait(stats_now() - t);
+}
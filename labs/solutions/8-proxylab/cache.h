@@ -0,0 +1,76 @@
+/*
+ * cache.h - web object cache shared by all proxy threads
+ */
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+/* Recommended max cache and object sizes */
+#define MAX_CACHE_SIZE 10490000
+#define MAX_OBJECT_SIZE 102400
+
+/* Default number of independently locked cache shards */
+#define DEFAULT_SHARDS 16
+
+/* Default eviction policy: "lru", "clock", "slru" or "gdsf" */
+#define DEFAULT_POLICY "lru"
+
+/* Default admission policy: "tinylfu" or "all" */
+#define DEFAULT_ADMISSION "tinylfu"
+
+/* Node of a circular doubly linked eviction queue */
+typedef struct cache_link
+{
+    struct cache_link *prev, *next;
+} cache_link;
+
+/*
+ * A cached object.  Once in the cache, cache_obj, object_size and
+ * cache_url never change, so a reader holding a reference (from
+ * cache_read) may use them without any lock until cache_release.  Only
+ * expires moves, when the end server confirms the object is current.
+ */
+typedef struct cache_block
+{
+    cache_link link;                    /* position in its eviction queue */
+    struct cache_block *hnext;          /* next block in the same bucket */
+    char *cache_url;
+    int object_size;
+    int block_bytes;    /* bytes charged to the shard budget */
+    int refcnt;         /* readers, plus one while in the cache */
+    int referenced;     /* hit since the policy last looked at it */
+    int segment;        /* queue of the shard the block is on */
+    int frequency;      /* gdsf: hits while cached, plus one */
+    int keyed;          /* gdsf: frequency priority was computed with */
+    int heapidx;        /* gdsf: position in the heap of the shard */
+    double priority;    /* gdsf: inflation + frequency / block_bytes */
+    unsigned int hash;  /* cache_hash(cache_url) */
+    long expires;       /* fresh until then, in seconds since the epoch */
+    char cache_obj[];   /* object_size bytes, followed by the url */
+} cache_block;
+
+/* What the cache did so far, summed over the shards */
+typedef struct
+{
+    long hits, misses;          /* lookups */
+    long stale, revalidated;    /* found stale, then confirmed current */
+    long hit_bytes, miss_bytes; /* bytes written to clients by each */
+    long inserted;              /* new objects stored without a decision */
+    long admitted, rejected;    /* new objects, by the admission policy */
+    long evicted;
+    long objects, bytes;        /* in the cache now */
+} cache_totals;
+
+/* functions for maintaining the cache of proxy */
+int cache_init(int nshards, char *policy, char *admission);
+unsigned int cache_hash(const char *url);
+cache_block *cache_read(char *url);
+int cache_fresh(cache_block *bp);
+void cache_refresh(cache_block *bp, long expires);
+void cache_served(cache_block *bp, long bytes);
+void cache_release(cache_block *bp);
+int cache_write(char *buf, char *url, int size, long expires);
+void cache_missed(long bytes);
+int cache_collect(cache_block ***blocks);
+void cache_stats(cache_totals *t);
+
+#endif /* __CACHE_H__ */
@@ -0,0 +1,328 @@
+/*
+ * disk.c - second cache tier in memory-mapped segment files
+ *
+ * Objects too large for the memory cache but at most DISK_SEGMENT bytes
+ * are kept in segment files under a directory given on the command line.
+ * Segments are filled like a log: every object gets the next bytes of
+ * the active segment, mapped into memory and written as the response
+ * streams by, and a full segment is followed by a new one.  Once the
+ * segments exceed the byte budget, the oldest one is evicted as a whole,
+ * along with the index entries of its objects.
+ *
+ * Space is reserved when the head of a response is known, so only
+ * responses with a Content-Length go to disk.  An object enters the index
+ * once all of its bytes are written; the space of an aborted one is
+ * reclaimed with its segment.  A new copy of an object, fetched once the
+ * old one is stale, replaces it in the index; a stale object the end
+ * server confirms is made fresh again in place (disk_refresh).
+ *
+ * Hits are sent straight from the mapped pages.  Segments are reference
+ * counted: a hit or a writer keeps its segment mapped even if it is
+ * evicted meanwhile, and the last reference unmaps it.
+ */
+#include "csapp.h"
+#include "proxy.h"
+#include "cache.h"
+#include "disk.h"
+#include <dirent.h>
+
+#define DISK_BUCKETS 4096       /* hash buckets of the index */
+
+/* Where an object lives */
+typedef struct disk_entry
+{
+    struct disk_entry *hnext;   /* next entry in the same bucket */
+    struct disk_entry *snext;   /* next entry of the same segment */
+    disk_segment *seg;
+    size_t off, size;
+    long expires;               /* fresh until then */
+    unsigned int hash;
+    char url[];
+} disk_entry;
+
+struct disk_segment
+{
+    struct disk_segment *next;  /* next younger segment */
+    int refcnt;                 /* the tier while live, hits and writers */
+    int dead;                   /* evicted, its entries are gone */
+    char *map;
+    size_t used;                /* bytes handed out */
+    disk_entry *entries;
+    char path[MAXLINE];
+};
+
+struct disk_writer
+{
+    disk_segment *seg;
+    size_t off, size;
+    size_t written;
+    long expires;
+    unsigned int hash;
+    char url[];
+};
+
+static pthread_rwlock_t disk_lock;  /* readers share, changes exclude */
+static disk_entry *buckets[DISK_BUCKETS];
+static disk_segment *oldest, *active;
+static int nsegments, max_segments;
+static unsigned int next_id;
+static char *disk_dir;
+
+static disk_entry *lookup(char *url, unsigned int hash);
+static void unindex(disk_entry *e);
+static disk_segment *segment_new(void);
+static void segment_evict(disk_segment *seg);
+static void segment_release(disk_segment *seg);
+
+/*
+ * Use dir for the disk tier, budget_mb megabytes at most; stale segment
+ * files are removed.  Return -1 if dir cannot be used.
+ */
+int disk_init(char *dir, long budget_mb)
+{
+    DIR *d = opendir(dir);
+    struct dirent *de;
+    char path[MAXLINE];
+
+    if (!d)
+    {
+        unix_error("disk tier directory");
+        return -1;
+    }
+    while ((de = readdir(d)))
+    {
+        if (!strncmp(de->d_name, "seg-", 4))
+        {
+            snprintf(path, MAXLINE, "%s/%s", dir, de->d_name);
+            unlink(path);
+        }
+    }
+    closedir(d);
+
+    disk_dir = dir;
+    max_segments = (budget_mb << 20) / DISK_SEGMENT;
+    if (max_segments < 2)
+        max_segments = 2;
+    pthread_rwlock_init(&disk_lock, NULL);
+    return 0;
+}
+
+/* Find url in the index, with disk_lock held */
+static disk_entry *lookup(char *url, unsigned int hash)
+{
+    for (disk_entry *e = buckets[hash % DISK_BUCKETS]; e; e = e->hnext)
+    {
+        if (e->hash == hash && !strcmp(e->url, url))
+            return e;
+    }
+    return NULL;
+}
+
+/* Find url on disk: return 0 and fill hit, to be released, or -1 */
+int disk_read(char *url, disk_hit *hit)
+{
+    if (!disk_dir)
+        return -1;
+
+    unsigned int hash = cache_hash(url);
+    pthread_rwlock_rdlock(&disk_lock);
+    disk_entry *e = lookup(url, hash);
+    if (e)
+    {
+        __atomic_add_fetch(&e->seg->refcnt, 1, __ATOMIC_RELAXED);
+        hit->seg = e->seg;
+        hit->data = e->seg->map + e->off;
+        hit->size = e->size;
+        hit->expires = __atomic_load_n(&e->expires, __ATOMIC_RELAXED);
+    }
+    pthread_rwlock_unlock(&disk_lock);
+    return e ? 0 : -1;
+}
+
+/* The end server confirmed the object of url: fresh until expires */
+void disk_refresh(char *url, long expires)
+{
+    if (!disk_dir)
+        return;
+
+    pthread_rwlock_rdlock(&disk_lock);
+    disk_entry *e = lookup(url, cache_hash(url));
+    if (e)
+        __atomic_store_n(&e->expires, expires, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&disk_lock);
+}
+
+void disk_release(disk_hit *hit)
+{
+    segment_release(hit->seg);
+    hit->seg = NULL;
+}
+
+/*
+ * Reserve size bytes for url, fresh until expires, to be filled with
+ * disk_append and ended with disk_commit; NULL if the object does not
+ * belong on disk
+ */
+disk_writer *disk_reserve(char *url, size_t size, long expires)
+{
+    if (!disk_dir || size <= MAX_OBJECT_SIZE || size > DISK_SEGMENT)
+        return NULL;
+
+    unsigned int hash = cache_hash(url);
+    disk_writer *w = malloc(sizeof(disk_writer) + strlen(url) + 1);
+    if (!w)
+        return NULL;
+    strcpy(w->url, url);
+    w->hash = hash;
+    w->size = size;
+    w->written = 0;
+    w->expires = expires;
+
+    pthread_rwlock_wrlock(&disk_lock);
+    disk_entry *old = lookup(url, hash);
+    if (old && __atomic_load_n(&old->expires, __ATOMIC_RELAXED) > time(NULL))
+    {
+        pthread_rwlock_unlock(&disk_lock);
+        free(w);
+        return NULL;
+    }
+    if (!active || active->used + size > DISK_SEGMENT)
+    {
+        disk_segment *seg = segment_new();
+        if (!seg)
+        {
+            pthread_rwlock_unlock(&disk_lock);
+            free(w);
+            return NULL;
+        }
+        if (active)
+            active->next = seg;
+        else
+            oldest = seg;
+        active = seg;
+        if (++nsegments > max_segments)
+            segment_evict(oldest);
+    }
+    w->seg = active;
+    w->off = active->used;
+    active->used += size;
+    __atomic_add_fetch(&active->refcnt, 1, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&disk_lock);
+    return w;
+}
+
+/* Write the next n bytes of the object */
+void disk_append(disk_writer *w, const char *buf, size_t n)
+{
+    if (w->written + n > w->size)
+        n = w->size - w->written;
+    memcpy(w->seg->map + w->off + w->written, buf, n);
+    w->written += n;
+}
+
+/* Put the object into the index if ok and complete, free w */
+void disk_commit(disk_writer *w, int ok)
+{
+    disk_entry *e = NULL;
+
+    if (ok && w->written == w->size)
+        e = malloc(sizeof(disk_entry) + strlen(w->url) + 1);
+    if (e)
+    {
+        strcpy(e->url, w->url);
+        e->hash = w->hash;
+        e->seg = w->seg;
+        e->off = w->off;
+        e->size = w->size;
+        e->expires = w->expires;
+
+        pthread_rwlock_wrlock(&disk_lock);
+        if (w->seg->dead)
+        {
+            free(e);
+            e = NULL;
+        }
+        else
+        {
+            disk_entry *old = lookup(w->url, w->hash);
+            if (old)                /* the stale copy, replaced */
+                unindex(old);
+            disk_entry **bucket = &buckets[w->hash % DISK_BUCKETS];
+            e->hnext = *bucket;
+            *bucket = e;
+            e->snext = w->seg->entries;
+            w->seg->entries = e;
+        }
+        pthread_rwlock_unlock(&disk_lock);
+        dbg_printf("disk tier %s %s\n", e ? "stored" : "dropped", w->url);
+    }
+    segment_release(w->seg);
+    free(w);
+}
+
+/*
+ * Create and map the next segment file, with disk_lock held.  Its blocks
+ * are allocated up front: a sparse file on a full file system would fault
+ * with SIGBUS on the first write to a hole rather than fail here.
+ */
+static disk_segment *segment_new(void)
+{
+    disk_segment *seg = calloc(1, sizeof(disk_segment));
+    if (!seg)
+        return NULL;
+
+    snprintf(seg->path, MAXLINE, "%s/seg-%06u", disk_dir, next_id++);
+    int fd = open(seg->path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    int rc = fd < 0 ? 0 : posix_fallocate(fd, 0, DISK_SEGMENT);
+    if (rc)
+        errno = rc;
+    if (fd < 0 || rc ||
+        (seg->map = mmap(NULL, DISK_SEGMENT, PROT_READ | PROT_WRITE,
+                         MAP_SHARED, fd, 0)) == MAP_FAILED)
+    {
+        unix_error("disk tier segment");
+        if (fd >= 0)
+        {
+            close(fd);
+            unlink(seg->path);
+        }
+        free(seg);
+        return NULL;
+    }
+    close(fd);                  /* the mapping keeps the file */
+    seg->refcnt = 1;
+    return seg;
+}
+
+/* Take e out of the index and its segment, with disk_lock held */
+static void unindex(disk_entry *e)
+{
+    disk_entry **pp = &buckets[e->hash % DISK_BUCKETS];
+    while (*pp != e)
+        pp = &(*pp)->hnext;
+    *pp = e->hnext;
+    for (pp = &e->seg->entries; *pp != e; pp = &(*pp)->snext)
+        ;
+    *pp = e->snext;
+    free(e);
+}
+
+/* Drop the oldest segment and its objects, with disk_lock held */
+static void segment_evict(disk_segment *seg)
+{
+    while (seg->entries)
+        unindex(seg->entries);
+    seg->dead = 1;
+    oldest = seg->next;
+    nsegments--;
+    unlink(seg->path);
+    segment_release(seg);
+}
+
+static void segment_release(disk_segment *seg)
+{
+    if (__atomic_sub_fetch(&seg->refcnt, 1, __ATOMIC_ACQ_REL))
+        return;
+    munmap(seg->map, DISK_SEGMENT);
+    free(seg);
+}
@@ -0,0 +1,35 @@
+/*
+ * disk.h - second cache tier in memory-mapped segment files
+ */
+#ifndef __DISK_H__
+#define __DISK_H__
+
+#include <stddef.h>
+
+/* Size of a segment file, also the largest object of the disk tier */
+#define DISK_SEGMENT (64 << 20)
+
+/* Default byte budget of the disk tier, in MB */
+#define DEFAULT_DISK_BUDGET 1024
+
+typedef struct disk_segment disk_segment;
+typedef struct disk_writer disk_writer;
+
+/* An object of the disk tier being sent, straight from mapped pages */
+typedef struct
+{
+    disk_segment *seg;          /* reference that keeps data mapped */
+    const char *data;
+    size_t size;
+    long expires;               /* fresh until then */
+} disk_hit;
+
+int disk_init(char *dir, long budget_mb);
+int disk_read(char *url, disk_hit *hit);
+void disk_refresh(char *url, long expires);
+void disk_release(disk_hit *hit);
+disk_writer *disk_reserve(char *url, size_t size, long expires);
+void disk_append(disk_writer *w, const char *buf, size_t n);
+void disk_commit(disk_writer *w, int ok);
+
+#endif /* __DISK_H__ */
@@ -0,0 +1,461 @@
+/*
+ * dns.c - cache of resolved end server addresses
+ *
+ * Connecting to an end server used to start with a getaddrinfo() call.
+ * Resolutions are now kept per (host, port) for ttl seconds, failures
+ * for DNS_NEGATIVE_TTL seconds.  Only the first connect to a (host, port)
+ * resolves: the refresher thread has entries resolved again shortly
+ * before they expire, and an expired entry is still handed out until its
+ * refresh is done.  A failed refresh does not replace addresses that are
+ * still valid.  Entries nobody looked up for a while are dropped instead
+ * of refreshed.
+ *
+ * getaddrinfo() blocks, for seconds when a server does not answer.  The
+ * threaded engine resolves a first lookup in its worker, but an event
+ * loop must not wait: it queues a dns_query for the resolver threads and
+ * watches the eventfd of the query, which is written once the addresses
+ * are known.  Refreshes go through the same threads.  A thread is added
+ * whenever more queries wait than resolvers do, up to DNS_RESOLVERS, so
+ * a slow name holds up one resolver rather than every name behind it.
+ *
+ * The address list is kept in the order getaddrinfo() sorted it (RFC
+ * 6724).  A list may be replaced while connects still walk the old one,
+ * so lists are refcounted.
+ */
+#include "csapp.h"
+#include "proxy.h"
+#include "dns.h"
+#include "trace.h"
+#include <sys/eventfd.h>
+
+#define DNS_BUCKETS 256         /* hash buckets of (host, port) entries */
+#define DNS_AHEAD 5             /* seconds before expiry to refresh */
+#define DNS_IDLE_TTLS 4         /* ttls without lookup before dropping */
+
+typedef struct dns_entry
+{
+    struct dns_entry *next;     /* next entry in the same bucket */
+    char *hostname, *port;
+    dns_addrs *addrs;
+    time_t expires;             /* end of the ttl of addrs */
+    time_t refresh;             /* when to resolve again */
+    time_t used;                /* time of the last lookup */
+    int refreshing;             /* queued for a resolver thread */
+} dns_entry;
+
+/*
+ * Work for the resolver threads: the refresh of entry, or else the first
+ * lookup of hostname:port for an event loop.  A lookup is shared by its
+ * resolver and the loop, the last one to let go frees it.
+ */
+struct dns_query
+{
+    struct dns_query *next;     /* next query in the queue */
+    dns_entry *entry;
+    char *hostname, *port;      /* of a lookup, copies */
+    dns_addrs *addrs;           /* result of a lookup */
+    int done;                   /* addrs is set */
+    int efd;                    /* eventfd written once done */
+    int refcnt;
+};
+
+static dns_entry *buckets[DNS_BUCKETS];
+static sem_t dns_mutex;         /* Protection for all entries */
+static int dns_ttl;
+
+static dns_query *queue_head, **queue_tail = &queue_head;
+static sem_t queue_mutex;       /* Protection for the queue and counts */
+static sem_t queue_items;       /* Counts queued queries */
+static int nqueued;             /* queries no resolver took yet */
+static int nwaiting;            /* resolvers waiting for a query */
+static int nresolvers;
+
+static unsigned int dns_hash(char *hostname, char *port);
+static dns_addrs *resolve(char *hostname, char *port);
+static void set_addrs(dns_entry *e, dns_addrs *addrs, time_t now);
+static void remember(char *hostname, char *port, dns_addrs *addrs);
+static void submit(dns_query *q);
+static void query_release(dns_query *q);
+static void refresh(dns_entry *e);
+static void *resolver(void *vargp);
+static void *refresher(void *vargp);
+
+/* init the cache to keep resolutions for ttl seconds, 0 disables it */
+void dns_init(int ttl)
+{
+    pthread_t tid;
+
+    dns_ttl = ttl;
+    Sem_init(&dns_mutex, 0, 1);
+    Sem_init(&queue_mutex, 0, 1);
+    Sem_init(&queue_items, 0, 0);
+    if (dns_ttl > 0)
+        Pthread_create(&tid, NULL, refresher, NULL);
+}
+
+static unsigned int dns_hash(char *hostname, char *port)
+{
+    unsigned int h = 2166136261u;
+    for (char *p = hostname; *p; ++p)
+        h = (h ^ (unsigned char)*p) * 16777619u;
+    for (char *p = port; *p; ++p)
+        h = (h ^ (unsigned char)*p) * 16777619u;
+    return h;
+}
+
+/* Resolve hostname:port, blocking; never NULL unless out of memory */
+static dns_addrs *resolve(char *hostname, char *port)
+{
+    struct addrinfo hints;
+    dns_addrs *addrs = malloc(sizeof(dns_addrs));
+    if (!addrs)
+        return NULL;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    addrs->refcnt = 1;
+    addrs->list = NULL;
+    addrs->err = getaddrinfo(hostname, port, &hints, &addrs->list);
+    if (addrs->err)
+    {
+        fprintf(stderr, "getaddrinfo failed (%s:%s): %s\n",
+                hostname, port, gai_strerror(addrs->err));
+        addrs->list = NULL;
+    }
+    return addrs;
+}
+
+/* Give e a new resolution, refreshed a little before its ttl ends */
+static void set_addrs(dns_entry *e, dns_addrs *addrs, time_t now)
+{
+    int ttl = dns_ttl, ahead = dns_ttl / 4;
+    if (addrs->err)
+    {
+        if (ttl > DNS_NEGATIVE_TTL)
+            ttl = DNS_NEGATIVE_TTL;
+        ahead = 0;
+    }
+    if (ahead > DNS_AHEAD)
+        ahead = DNS_AHEAD;
+    e->addrs = addrs;
+    e->expires = now + ttl;
+    e->refresh = e->expires - ahead;
+}
+
+/*
+ * The cached addresses of hostname:port, to be released with
+ * dns_release; NULL if it was not resolved yet or the cache is disabled
+ */
+dns_addrs *dns_cached(char *hostname, char *port)
+{
+    if (dns_ttl <= 0)
+        return NULL;
+
+    unsigned int h = dns_hash(hostname, port);
+    dns_addrs *addrs = NULL;
+
+    P(&dns_mutex);
+    for (dns_entry *e = buckets[h % DNS_BUCKETS]; e; e = e->next)
+    {
+        if (!strcmp(e->hostname, hostname) && !strcmp(e->port, port))
+        {
+            addrs = e->addrs;
+            __atomic_add_fetch(&addrs->refcnt, 1, __ATOMIC_RELAXED);
+            e->used = time(NULL);
+            break;
+        }
+    }
+    V(&dns_mutex);
+    return addrs;
+}
+
+/*
+ * The addresses of hostname:port, to be released with dns_release; check
+ * err before using the list.  Blocks on a first lookup.  Returns NULL if
+ * out of memory.
+ */
+dns_addrs *dns_lookup(char *hostname, char *port)
+{
+    dns_addrs *addrs = dns_cached(hostname, port);
+
+    if (!addrs && (addrs = resolve(hostname, port)) && dns_ttl > 0)
+        remember(hostname, port, addrs);
+    return addrs;
+}
+
+/* Add the new resolution addrs of hostname:port to the cache */
+static void remember(char *hostname, char *port, dns_addrs *addrs)
+{
+    dns_entry **bucket = &buckets[dns_hash(hostname, port) % DNS_BUCKETS];
+    dns_entry *e = malloc(sizeof(dns_entry));
+    time_t now = time(NULL);
+
+    if (!e || !(e->hostname = strdup(hostname)))
+    {
+        free(e);
+        return;
+    }
+    if (!(e->port = strdup(port)))
+    {
+        free(e->hostname);
+        free(e);
+        return;
+    }
+    set_addrs(e, addrs, now);
+    e->used = now;
+    e->refreshing = 0;
+    addrs->refcnt++;            /* one for the cache, one for the caller */
+
+    /* Someone may have resolved it meanwhile, two entries do no harm */
+    P(&dns_mutex);
+    e->next = *bucket;
+    *bucket = e;
+    V(&dns_mutex);
+}
+
+/*
+ * Have hostname:port resolved without blocking: dns_query_fd() becomes
+ * readable once dns_query_done(); NULL on error
+ */
+dns_query *dns_query_start(char *hostname, char *port)
+{
+    dns_query *q = calloc(1, sizeof(dns_query));
+    if (!q)
+        return NULL;
+    q->hostname = strdup(hostname);
+    q->port = strdup(port);
+    q->efd = eventfd(0, EFD_NONBLOCK);
+    if (!q->hostname || !q->port || q->efd < 0)
+    {
+        if (q->efd >= 0)
+            Close(q->efd);
+        free(q->hostname);
+        free(q->port);
+        free(q);
+        return NULL;
+    }
+    q->refcnt = 2;              /* the caller and the resolver */
+    submit(q);
+    return q;
+}
+
+int dns_query_fd(dns_query *q)
+{
+    return q->efd;
+}
+
+/* Whether the resolver is done with q */
+int dns_query_done(dns_query *q)
+{
+    return __atomic_load_n(&q->done, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Let go of q, done or not; return its addresses if it is done, to be
+ * released with dns_release, NULL otherwise or if out of memory.  Stop
+ * watching its descriptor first: the resolver may still write it.
+ */
+dns_addrs *dns_query_end(dns_query *q)
+{
+    dns_addrs *addrs = NULL;
+
+    if (dns_query_done(q))
+    {
+        addrs = q->addrs;
+        q->addrs = NULL;
+    }
+    query_release(q);
+    return addrs;
+}
+
+static void query_release(dns_query *q)
+{
+    if (__atomic_sub_fetch(&q->refcnt, 1, __ATOMIC_ACQ_REL))
+        return;
+    if (q->addrs)
+        dns_release(q->addrs);
+    if (q->efd >= 0)
+        Close(q->efd);
+    free(q->hostname);
+    free(q->port);
+    free(q);
+}
+
+/* Queue q for the resolver threads, starting one if they are all busy */
+static void submit(dns_query *q)
+{
+    pthread_t tid;
+    int start;
+
+    q->next = NULL;
+    P(&queue_mutex);
+    *queue_tail = q;
+    queue_tail = &q->next;
+    start = ++nqueued > nwaiting && nresolvers < DNS_RESOLVERS;
+    if (start)
+    {
+        nresolvers++;
+        nwaiting++;
+    }
+    V(&queue_mutex);
+    V(&queue_items);
+    if (start)
+        Pthread_create(&tid, NULL, resolver, NULL);
+}
+
+void dns_release(dns_addrs *addrs)
+{
+    if (__atomic_sub_fetch(&addrs->refcnt, 1, __ATOMIC_ACQ_REL))
+        return;
+    if (addrs->list)
+        freeaddrinfo(addrs->list);
+    free(addrs);
+}
+
+/* open_clientfd() of csapp.c, with cached addresses */
+int dns_clientfd(char *hostname, char *port)
+{
+    int clientfd = -1;
+    struct addrinfo *p;
+    dns_addrs *addrs = dns_lookup(hostname, port);
+
+    if (!addrs)
+        return -1;
+    trace_mark(TRACE_DNS);
+    for (p = addrs->list; p; p = p->ai_next)
+    {
+        if ((clientfd = socket(p->ai_family, p->ai_socktype,
+                               p->ai_protocol)) < 0)
+            continue;
+        if (connect(clientfd, p->ai_addr, p->ai_addrlen) != -1)
+            break;
+        Close(clientfd);
+        clientfd = -1;
+    }
+    dns_release(addrs);
+    return clientfd;
+}
+
+/* Resolve the queries of the queue, one at a time */
+static void *resolver(void *vargp)
+{
+    Pthread_detach(pthread_self());
+    while (1)
+    {
+        P(&queue_items);
+        P(&queue_mutex);
+        dns_query *q = queue_head;
+        if (!(queue_head = q->next))
+            queue_tail = &queue_head;
+        nqueued--;
+        nwaiting--;
+        V(&queue_mutex);
+
+        if (q->entry)
+        {
+            refresh(q->entry);
+            free(q);
+        }
+        else
+        {
+            /* An earlier query may have resolved the name meanwhile */
+            uint64_t one = 1;
+            dns_addrs *addrs = dns_cached(q->hostname, q->port);
+            if (!addrs && (addrs = resolve(q->hostname, q->port)) &&
+                dns_ttl > 0)
+                remember(q->hostname, q->port, addrs);
+            q->addrs = addrs;
+            __atomic_store_n(&q->done, 1, __ATOMIC_RELEASE);
+            if (write(q->efd, &one, sizeof(one)) < 0)
+                unix_error("eventfd write error");
+            query_release(q);
+        }
+
+        P(&queue_mutex);
+        nwaiting++;
+        V(&queue_mutex);
+    }
+    return NULL;
+}
+
+/* Resolve e again, for the refresher */
+static void refresh(dns_entry *e)
+{
+    dns_addrs *addrs = resolve(e->hostname, e->port), *old = NULL;
+    time_t now = time(NULL);
+
+    P(&dns_mutex);
+    if (addrs)
+    {
+        /* Keep valid addresses over a failure, retry later */
+        old = e->addrs;
+        if (addrs->err && !old->err && e->expires > now)
+        {
+            old = addrs;
+            e->refresh = now + DNS_NEGATIVE_TTL;
+        }
+        else
+            set_addrs(e, addrs, now);
+    }
+    e->refreshing = 0;
+    V(&dns_mutex);
+    if (old)
+        dns_release(old);
+}
+
+/*
+ * Queue the entries about to expire for the resolver threads, drop the
+ * ones nobody uses.  Only this thread removes entries, and never one
+ * being refreshed, so a resolver may refresh an entry without the lock.
+ */
+static void *refresher(void *vargp)
+{
+    Pthread_detach(pthread_self());
+    while (1)
+    {
+        Sleep(1);
+        time_t now = time(NULL);
+
+        for (int b = 0; b < DNS_BUCKETS; ++b)
+        {
+            dns_entry *idle = NULL;
+
+            P(&dns_mutex);
+            dns_entry **pp = &buckets[b];
+            while (*pp)
+            {
+                dns_entry *e = *pp;
+                dns_query *q;
+                if (!e->refreshing &&
+                    now - e->used >= DNS_IDLE_TTLS * dns_ttl)
+                {
+                    *pp = e->next;
+                    e->next = idle;
+                    idle = e;
+                    continue;
+                }
+                if (!e->refreshing && e->refresh <= now &&
+                    (q = calloc(1, sizeof(dns_query))))
+                {
+                    q->entry = e;
+                    e->refreshing = 1;
+                    submit(q);
+                }
+                pp = &e->next;
+            }
+            V(&dns_mutex);
+
+            while (idle)
+            {
+                dns_entry *e = idle;
+                idle = e->next;
+                dns_release(e->addrs);
+                free(e->hostname);
+                free(e->port);
+                free(e);
+            }
+        }
+    }
+    return NULL;
+}
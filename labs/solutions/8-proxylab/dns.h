@@ -0,0 +1,40 @@
+/*
+ * dns.h - cache of resolved end server addresses
+ */
+#ifndef __DNS_H__
+#define __DNS_H__
+
+#include "csapp.h"
+
+/* Default seconds a resolution is used before it is refreshed */
+#define DEFAULT_DNS_TTL 60
+
+/* Seconds a failed resolution is remembered, at most the ttl */
+#define DNS_NEGATIVE_TTL 5
+
+/* Threads resolving for the event loops and the refresher, at most */
+#define DNS_RESOLVERS 16
+
+/* A resolution shared by every connect to the same (host, port) */
+typedef struct
+{
+    int refcnt;
+    int err;                    /* getaddrinfo error, 0 if list is valid */
+    struct addrinfo *list;
+} dns_addrs;
+
+/* A resolution in the background, for an event loop */
+typedef struct dns_query dns_query;
+
+void dns_init(int ttl);
+dns_addrs *dns_cached(char *hostname, char *port);
+dns_addrs *dns_lookup(char *hostname, char *port);
+void dns_release(dns_addrs *addrs);
+int dns_clientfd(char *hostname, char *port);
+
+dns_query *dns_query_start(char *hostname, char *port);
+int dns_query_fd(dns_query *q);
+int dns_query_done(dns_query *q);
+dns_addrs *dns_query_end(dns_query *q);
+
+#endif /* __DNS_H__ */
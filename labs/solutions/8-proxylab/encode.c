@@ -0,0 +1,201 @@
+/*
+ * encode.c - gzip variants of cached objects
+ *
+ * The proxy asks end servers for the identity coding only (see
+ * build_request), and when it caches a text response worth compressing
+ * it keeps the gzip variant instead, compressed once when the object is
+ * filled.  Clients that take gzip get the stored bytes as they are, and
+ * the same cache budget holds several times as many objects.  A client
+ * that does not is sent the object inflated again on each hit; the
+ * length it needs is in the gzip trailer, so nothing else is kept.
+ *
+ * The head of a variant is the original one with Content-Encoding: gzip,
+ * its own Content-Length and Vary: Accept-Encoding, since the response
+ * now depends on that header.  A strong ETag is made weak: the bytes are
+ * not those the end server tagged, but a conditional request with it
+ * still matches.  Inflating restores the Content-Length and drops the
+ * Content-Encoding; the rest of the head stays as stored.
+ */
+#include "csapp.h"
+#include "http.h"
+#include "encode.h"
+#include <zlib.h>
+
+/* deflate window of 2^15 bytes, with a gzip header and trailer */
+#define GZIP_WINDOW (15 + 16)
+
+/* Compression level, zlib's usual trade of time for size */
+#define ENCODE_LEVEL 6
+
+/* A variant is kept only below this percentage of the original size */
+#define ENCODE_RATIO 90
+
+/* Room for the headers a variant gains */
+#define ENCODE_HEAD_EXTRA 128
+
+/* Content types worth compressing, by prefix */
+static const char *const text_types[] = {
+    "text/", "application/javascript", "application/x-javascript",
+    "application/json", "application/xml", "application/xhtml+xml",
+    "image/svg+xml", NULL,
+};
+
+static int compressible(const char *head, size_t hsize);
+static size_t copy_head(char *out, const char *head, size_t hsize,
+                        const char *const *drop);
+
+/*
+ * The gzip variant of the stored object of size bytes, malloc'ed, and
+ * its size in *outsize; NULL if the object is not worth compressing
+ */
+char *encode_gzip(const char *obj, size_t size, size_t *outsize)
+{
+    static const char *const drop[] = {"Content-Length", "ETag", "Vary",
+                                       NULL};
+    size_t hsize = resp_head_size(obj, size), bodylen = size - hsize;
+    z_stream zs;
+
+    if (!hsize || bodylen < ENCODE_MIN || !compressible(obj, hsize))
+        return NULL;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, ENCODE_LEVEL, Z_DEFLATED, GZIP_WINDOW, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+        return NULL;
+
+    /* Compress right where the body of the variant goes */
+    http_str etag = head_header(obj, hsize, "ETag");
+    http_str vary = head_header(obj, hsize, "Vary");
+    size_t room = hsize + etag.len + vary.len + ENCODE_HEAD_EXTRA;
+    char *out = Malloc(room + deflateBound(&zs, bodylen));
+    zs.next_in = (Bytef *)obj + hsize;
+    zs.avail_in = bodylen;
+    zs.next_out = (Bytef *)out + room;
+    zs.avail_out = deflateBound(&zs, bodylen);
+    int rc = deflate(&zs, Z_FINISH);
+    size_t zlen = zs.total_out;
+    deflateEnd(&zs);
+    if (rc != Z_STREAM_END || room + zlen > size / 100 * ENCODE_RATIO)
+    {
+        Free(out);
+        return NULL;
+    }
+
+    size_t len = copy_head(out, obj, hsize, drop);
+    if (etag.len)
+        len += sprintf(out + len, "ETag: %s%.*s\r\n",
+                       etag.p[0] == '"' ? "W/" : "", (int)etag.len, etag.p);
+    if (!vary.len)
+        len += sprintf(out + len, "Vary: Accept-Encoding\r\n");
+    else if (has_token(vary.p, vary.len, "*") ||
+             has_token(vary.p, vary.len, "Accept-Encoding"))
+        len += sprintf(out + len, "Vary: %.*s\r\n", (int)vary.len, vary.p);
+    else
+        len += sprintf(out + len, "Vary: %.*s, Accept-Encoding\r\n",
+                       (int)vary.len, vary.p);
+    len += sprintf(out + len, "Content-Encoding: gzip\r\n"
+                              "Content-Length: %zu\r\n\r\n", zlen);
+    memmove(out + len, out + room, zlen);
+    *outsize = len + zlen;
+    return out;
+}
+
+/*
+ * The stored gzip object of size bytes inflated back, malloc'ed, and its
+ * size in *outsize; NULL if it is not gzip or cannot be inflated
+ */
+char *encode_plain(const char *obj, size_t size, size_t *outsize)
+{
+    static const char *const drop[] = {"Content-Length", "Content-Encoding",
+                                       NULL};
+    size_t hsize = resp_head_size(obj, size), bodylen = size - hsize;
+    http_str coding = head_header(obj, hsize, "Content-Encoding");
+    z_stream zs;
+
+    if (!hsize || !str_is(coding, "gzip") || bodylen < 18)
+        return NULL;
+
+    /* The trailer ends with the inflated length, modulo 2^32 */
+    const unsigned char *t = (const unsigned char *)obj + size - 4;
+    size_t plain = t[0] | t[1] << 8 | t[2] << 16 | (size_t)t[3] << 24;
+    if (plain > ENCODE_MAX_PLAIN)
+        return NULL;
+
+    char *out = Malloc(hsize + ENCODE_HEAD_EXTRA + plain);
+    size_t len = copy_head(out, obj, hsize, drop);
+    len += sprintf(out + len, "Content-Length: %zu\r\n\r\n", plain);
+
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, GZIP_WINDOW) != Z_OK)
+    {
+        Free(out);
+        return NULL;
+    }
+    zs.next_in = (Bytef *)obj + hsize;
+    zs.avail_in = bodylen;
+    zs.next_out = (Bytef *)out + len;
+    zs.avail_out = plain;
+    int rc = inflate(&zs, Z_FINISH);
+    size_t total = zs.total_out;
+    inflateEnd(&zs);
+    if (rc != Z_STREAM_END || total != plain)
+    {
+        Free(out);
+        return NULL;
+    }
+    *outsize = len + plain;
+    return out;
+}
+
+/*
+ * Whether the response with the stored head of hsize bytes may and
+ * should be compressed: a complete 200 of a text type, in no coding yet
+ */
+static int compressible(const char *head, size_t hsize)
+{
+    http_str type = head_header(head, hsize, "Content-Type");
+    http_str cc = head_header(head, hsize, "Cache-Control");
+
+    if (resp_status(head, hsize) != 200 ||
+        head_header(head, hsize, "Content-Encoding").p ||
+        head_header(head, hsize, "Transfer-Encoding").p ||
+        head_header(head, hsize, "Content-Range").p ||
+        has_token(cc.p, cc.len, "no-transform"))
+        return 0;
+    for (int i = 0; text_types[i]; ++i)
+    {
+        size_t n = strlen(text_types[i]);
+        if (type.len >= n && !strncasecmp(type.p, text_types[i], n))
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Copy the stored head of hsize bytes to out without its final CRLF and
+ * without the headers named in drop; return the bytes copied
+ */
+static size_t copy_head(char *out, const char *head, size_t hsize,
+                        const char *const *drop)
+{
+    const char *p = head, *end = head + hsize - 2;
+    size_t len = 0;
+
+    while (p < end)
+    {
+        const char *nl = memchr(p, '\n', end - p);
+        const char *next = nl ? nl + 1 : end;
+        int keep = 1;
+        for (int i = 0; keep && drop[i]; ++i)
+        {
+            size_t n = strlen(drop[i]);
+            keep = next - p <= n || p[n] != ':' || strncasecmp(p, drop[i], n);
+        }
+        if (keep)
+        {
+            memcpy(out + len, p, next - p);
+            len += next - p;
+        }
+        p = next;
+    }
+    return len;
+}
@@ -0,0 +1,18 @@
+/*
+ * encode.h - gzip variants of cached objects
+ */
+#ifndef __ENCODE_H__
+#define __ENCODE_H__
+
+#include <stddef.h>
+
+/* Smallest body worth compressing */
+#define ENCODE_MIN 256
+
+/* Largest body inflated for a client that does not take gzip */
+#define ENCODE_MAX_PLAIN (64 << 20)
+
+char *encode_gzip(const char *obj, size_t size, size_t *outsize);
+char *encode_plain(const char *obj, size_t size, size_t *outsize);
+
+#endif /* __ENCODE_H__ */
@@ -0,0 +1,1454 @@
+/*
+ * event.c - event-driven engine of the proxy
+ *
+ * Every loop thread owns an edge-triggered epoll instance.  The listening
+ * socket is shared and registered with EPOLLEXCLUSIVE, so an incoming
+ * connection wakes only one loop.  The threaded engine runs a few loops
+ * without listening socket and hands them its CONNECT tunnels through
+ * the inbox pipe of a loop (see event_tunnel).  Each client connection
+ * is a small state machine:
+ *
+ *   ST_REQUEST   read request line and headers from the client
+ *   ST_HIT       write a cached object straight from the memory cache or
+ *                from the mapped pages of the disk tier
+ *   ST_RESOLVE   wait for a resolver thread to find the end server, whose
+ *                name is not in the dns cache (see dns.c)
+ *   ST_CONNECT   non-blocking connect to the end server, unless the
+ *                upstream pool has an idle connection to it
+ *   ST_FORWARD   send the rewritten request to the end server
+ *   ST_RELAY     relay the response to the client and fill the cache,
+ *                then give the server connection back to the pool
+ *   ST_FOLLOW    relay the response another request is fetching for
+ *                the same url (see flight.c)
+ *   ST_ESTABLISH write the CONNECT reply to the client
+ *   ST_TUNNEL    relay bytes in both directions (https), through a
+ *                kernel pipe per direction with splice() if possible
+ *
+ * Once a response is sent the connection goes back to ST_REQUEST for the
+ * next (possibly already pipelined) request, unless the client or the
+ * response asked for it to be closed or it served client_requests
+ * requests.  Each loop wakes up every second to close connections that
+ * waited for a request for more than client_timeout seconds, and tunnels
+ * idle for more than tunnel_timeout seconds.
+ *
+ * Since descriptors are edge-triggered, every wakeup simply drives the
+ * state machine until the pending operation would block.
+ */
+#include "csapp.h"
+#include "proxy.h"
+#include "cache.h"
+#include "http.h"
+#include "upstream.h"
+#include "flight.h"
+#include "tunnel.h"
+#include "dns.h"
+#include "disk.h"
+#include "encode.h"
+#include "stats.h"
+#include "trace.h"
+#include <sys/epoll.h>
+
+#define MAX_EVENTS 64
+#define SWEEP_MS 1000               /* period of the idle connection sweep */
+
+enum
+{
+    ST_REQUEST,
+    ST_HIT,
+    ST_RESOLVE,
+    ST_CONNECT,
+    ST_FORWARD,
+    ST_RELAY,
+    ST_FOLLOW,
+    ST_ESTABLISH,
+    ST_TUNNEL
+};
+
+/* growable byte buffer, data[off, len) is pending */
+typedef struct
+{
+    char *data;
+    size_t off;
+    size_t len;
+    size_t cap;
+} ebuf_t;
+
+struct conn;
+
+/* what an epoll event points to */
+typedef struct
+{
+    struct conn *c;
+    int fd;
+} endpoint_t;
+
+typedef struct evloop
+{
+    int epfd;
+    int listenfd;           /* -1 for a loop that only serves tunnels */
+    int inbox[2];           /* pipe of conn pointers handed to the loop */
+    struct conn *dead;      /* closed connections, freed after a batch */
+    struct conn *conns;     /* open connections, for the idle sweep */
+    time_t swept;           /* time of the last sweep */
+} evloop_t;
+
+typedef struct conn
+{
+    endpoint_t client, server;
+    endpoint_t notify;      /* progress of the flight followed */
+    endpoint_t resolved;    /* eventfd of query */
+    evloop_t *loop;
+    int state;
+    int closed;
+    int https;
+    int keep;               /* serve another request after this one */
+    int accepted;           /* counted as an open client connection */
+    int outcome;            /* how the request is served, for the stats */
+    long started;           /* when its head was complete */
+    long begun;             /* when its first bytes came, 0 not yet */
+    trace_record trace;     /* phases of the request, if traced */
+    int nrequests;          /* requests read so far */
+    time_t idle_since;      /* when it started waiting for a request */
+    ebuf_t in;              /* request bytes from the client */
+    http_req req;           /* the request in c->in, as it is parsed */
+    ebuf_t up;              /* bytes to the end server */
+    int reused;             /* server connection came from the pool */
+    http_resp resp;         /* framing of the response being relayed */
+    int head_done;          /* response head rewritten and queued */
+    flight *flight;         /* flight of the miss, led or followed */
+    int leader;
+    flight_cursor cursor;   /* follower: body bytes already sent */
+    ebuf_t down;            /* bytes to the client */
+    cache_block *hit;       /* cached object being sent */
+    disk_hit dhit;          /* or object of the disk tier being sent */
+    const char *obj;        /* bytes of either, stale while revalidated */
+    char *plain;            /* or obj inflated for the client, to free */
+    size_t obj_size;
+    size_t hit_off;         /* bytes of obj already sent */
+    size_t hit_sent;        /* bytes of the hit written, head included */
+    disk_writer *dw;        /* large response going to the disk tier */
+    int up_eof, down_eof;   /* tunnel: source side has shut down */
+    tunnel_pipe up_pipe, down_pipe;     /* tunnel: splice pipes */
+    char *cache_buf;        /* response copy for the cache */
+    int totallen;           /* size of response */
+    long expires;           /* response fresh until, -1 not to be cached */
+    dns_query *query;       /* resolution of the end server under way */
+    dns_addrs *addrs;       /* cached addresses of the end server */
+    struct addrinfo *ai_cur;    /* the one being connected to */
+    char *hostname, *port;  /* end server of an http request */
+    char *uri;              /* of an http request, the cache key */
+    struct conn *next;
+    struct conn *lprev, *lnext;     /* loop->conns */
+} conn_t;
+
+static evloop_t *loop_new(int listenfd);
+static void *loop_thread(void *vargp);
+static void loop_serve(evloop_t *loop);
+static void accept_all(evloop_t *loop);
+static void adopt_all(evloop_t *loop);
+static conn_t *conn_new(int connfd);
+static int conn_attach(evloop_t *loop, conn_t *c);
+static void conn_drive(conn_t *c);
+static void conn_close(conn_t *c);
+static int conn_next(conn_t *c);
+static void count_request(conn_t *c);
+static void sweep_idle(evloop_t *loop);
+static int watch(evloop_t *loop, endpoint_t *ep);
+static int set_nonblocking(int fd);
+static int set_blocking(int fd);
+
+static int on_request(conn_t *c);
+static int on_hit(conn_t *c);
+static int on_resolve(conn_t *c);
+static int on_connect(conn_t *c);
+static int on_forward(conn_t *c);
+static int on_relay(conn_t *c);
+static int on_follow(conn_t *c);
+static int on_establish(conn_t *c);
+static int on_tunnel(conn_t *c);
+
+static int start_upstream(conn_t *c);
+static int start_connect(conn_t *c, char *hostname, char *port);
+static int connect_addrs(conn_t *c);
+static dns_addrs *end_query(conn_t *c);
+static void release_upstream(conn_t *c);
+static int try_connect(conn_t *c);
+static int pump(int srcfd, int dstfd, ebuf_t *b, int *eof);
+static int tunnel_dir(int srcfd, int dstfd, ebuf_t *b, tunnel_pipe *p,
+                      int *eof);
+static int relay_head(conn_t *c);
+static int not_modified(conn_t *c);
+static void drop_stale(conn_t *c);
+static int start_hit(conn_t *c, const char *obj, size_t size);
+static int start_miss(conn_t *c);
+static int start_follow(conn_t *c);
+static void drop_flight(conn_t *c);
+
+static int ebuf_reserve(ebuf_t *b, size_t n);
+static int ebuf_append(ebuf_t *b, const char *s, size_t n);
+static int ebuf_read(int fd, ebuf_t *b, size_t n);
+static int ebuf_flush(int fd, ebuf_t *b);
+static void ebuf_consume(ebuf_t *b, size_t n);
+static void ebuf_free(ebuf_t *b);
+
+/*
+ * Results of state handlers: DRIVE_BLOCK waits for the next event,
+ * DRIVE_NEXT runs the (new) state again, DRIVE_CLOSE drops the connection
+ */
+#define DRIVE_BLOCK 0
+#define DRIVE_NEXT 1
+#define DRIVE_CLOSE -1
+
+/* Loops serving the tunnels of the threaded engine */
+static evloop_t **tunnel_loops;
+static int ntunnel_loops;
+static unsigned int next_tunnel_loop;
+
+/* What the inbox pipe of a loop points to */
+static endpoint_t inbox_mark;
+
+/* Serve listenfd with nloops event loops, never returns */
+void event_run(int listenfd, int nloops)
+{
+    pthread_t tid;
+
+    if (set_nonblocking(listenfd) < 0)
+        exit(1);
+
+    for (int i = 1; i < nloops; ++i)
+        Pthread_create(&tid, NULL, loop_thread, loop_new(listenfd));
+    loop_thread(loop_new(listenfd));
+}
+
+/* Start nloops event loops for the tunnels of the threaded engine */
+void event_tunnels(int nloops)
+{
+    pthread_t tid;
+
+    tunnel_loops = Malloc(nloops * sizeof(evloop_t *));
+    ntunnel_loops = nloops;
+    for (int i = 0; i < nloops; ++i)
+    {
+        tunnel_loops[i] = loop_new(-1);
+        Pthread_create(&tid, NULL, loop_thread, tunnel_loops[i]);
+    }
+}
+
+/*
+ * Hand an established tunnel to a tunnel loop, along with the bytes the
+ * client sent past its CONNECT headers; the loop owns both descriptors
+ */
+void event_tunnel(int clientfd, int serverfd, char *pending, size_t len)
+{
+    conn_t *c = conn_new(clientfd);
+    c->server.fd = serverfd;
+    c->https = 1;
+    c->state = ST_TUNNEL;
+    c->idle_since = time(NULL);
+    if (set_nonblocking(clientfd) < 0 || set_nonblocking(serverfd) < 0 ||
+        (len && ebuf_append(&c->up, pending, len) < 0))
+    {
+        Close(clientfd);
+        Close(serverfd);
+        ebuf_free(&c->up);
+        Free(c);
+        return;
+    }
+    stats_tunnel(1);
+    if (tunnel_splice)
+    {
+        tpipe_open(&c->up_pipe);
+        tpipe_open(&c->down_pipe);
+    }
+
+    unsigned int i = __atomic_fetch_add(&next_tunnel_loop, 1,
+                                        __ATOMIC_RELAXED);
+    Rio_writen(tunnel_loops[i % ntunnel_loops]->inbox[1], (char *)&c,
+               sizeof(c));
+}
+
+static evloop_t *loop_new(int listenfd)
+{
+    evloop_t *loop = Calloc(1, sizeof(evloop_t));
+    struct epoll_event ev;
+
+    loop->listenfd = listenfd;
+    loop->swept = time(NULL);
+    if ((loop->epfd = epoll_create1(0)) < 0)
+    {
+        unix_error("epoll_create1 error");
+        exit(1);
+    }
+    if (listenfd >= 0)
+    {
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.ptr = NULL;     /* NULL marks the listening socket */
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0)
+        {
+            unix_error("epoll_ctl error");
+            exit(1);
+        }
+    }
+
+    /* The write end stays blocking: a pointer is written at once */
+    if (pipe(loop->inbox) < 0 || set_nonblocking(loop->inbox[0]) < 0)
+    {
+        unix_error("pipe error");
+        exit(1);
+    }
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &inbox_mark;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->inbox[0], &ev) < 0)
+    {
+        unix_error("epoll_ctl error");
+        exit(1);
+    }
+    return loop;
+}
+
+static void *loop_thread(void *vargp)
+{
+    loop_serve((evloop_t *)vargp);
+    return NULL;
+}
+
+static void loop_serve(evloop_t *loop)
+{
+    struct epoll_event events[MAX_EVENTS];
+
+    while (1)
+    {
+        int n = epoll_wait(loop->epfd, events, MAX_EVENTS, SWEEP_MS);
+        if (n < 0)
+        {
+            if (errno != EINTR)
+                unix_error("epoll_wait error");
+            continue;
+        }
+        for (int i = 0; i < n; ++i)
+        {
+            endpoint_t *ep = events[i].data.ptr;
+            if (!ep)
+                accept_all(loop);
+            else if (ep == &inbox_mark)
+                adopt_all(loop);
+            else if (!ep->c->closed)
+                conn_drive(ep->c);
+        }
+        if (time(NULL) - loop->swept >= SWEEP_MS / 1000)
+            sweep_idle(loop);
+
+        /* No event of this batch can refer to them any more */
+        while (loop->dead)
+        {
+            conn_t *c = loop->dead;
+            loop->dead = c->next;
+            Free(c);
+        }
+    }
+}
+
+/* Accept every pending connection and register it with this loop */
+static void accept_all(evloop_t *loop)
+{
+    while (1)
+    {
+        int connfd = accept(loop->listenfd, NULL, NULL);
+        if (connfd < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                unix_error("accept error");
+            return;
+        }
+        if (set_nonblocking(connfd) < 0)
+        {
+            Close(connfd);
+            continue;
+        }
+
+        conn_t *c = conn_new(connfd);
+        c->accepted = 1;
+        c->begun = stats_now();
+        stats_connection(1);
+        if (conn_attach(loop, c) == 0)
+            conn_drive(c);
+    }
+}
+
+/* Take over every connection handed to this loop */
+static void adopt_all(evloop_t *loop)
+{
+    conn_t *c;
+    while (read(loop->inbox[0], &c, sizeof(c)) == sizeof(c))
+    {
+        if (conn_attach(loop, c) == 0)
+            conn_drive(c);
+    }
+}
+
+static conn_t *conn_new(int connfd)
+{
+    conn_t *c = Calloc(1, sizeof(conn_t));
+    c->state = ST_REQUEST;
+    c->client.c = c;
+    c->client.fd = connfd;
+    c->server.c = c;
+    c->server.fd = -1;
+    c->notify.c = c;
+    c->notify.fd = -1;
+    c->resolved.c = c;
+    c->resolved.fd = -1;
+    c->up_pipe.fds[0] = c->up_pipe.fds[1] = -1;
+    c->down_pipe.fds[0] = c->down_pipe.fds[1] = -1;
+    c->idle_since = time(NULL);
+    req_init(&c->req);
+    return c;
+}
+
+/* Make c a connection of loop, closing it on error */
+static int conn_attach(evloop_t *loop, conn_t *c)
+{
+    c->loop = loop;
+    c->lnext = loop->conns;
+    if (loop->conns)
+        loop->conns->lprev = c;
+    loop->conns = c;
+    if (watch(loop, &c->client) < 0 ||
+        (c->server.fd >= 0 && watch(loop, &c->server) < 0))
+    {
+        conn_close(c);
+        return -1;
+    }
+    return 0;
+}
+
+/* Close the connections waiting too long for a request, and idle tunnels */
+static void sweep_idle(evloop_t *loop)
+{
+    time_t now = time(NULL);
+    conn_t *c = loop->conns;
+    loop->swept = now;
+    while (c)
+    {
+        conn_t *next = c->lnext;
+        if ((c->state == ST_REQUEST &&
+             now - c->idle_since >= client_timeout) ||
+            (c->state == ST_TUNNEL && now - c->idle_since >= tunnel_timeout))
+        {
+            dbg_printf("closing idle connection\n");
+            conn_close(c);
+        }
+        c = next;
+    }
+}
+
+static int set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+    {
+        unix_error("fcntl error");
+        return -1;
+    }
+    return 0;
+}
+
+static int set_blocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) < 0)
+    {
+        unix_error("fcntl error");
+        return -1;
+    }
+    return 0;
+}
+
+static int watch(evloop_t *loop, endpoint_t *ep)
+{
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = ep;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, ep->fd, &ev) < 0)
+    {
+        unix_error("epoll_ctl error");
+        return -1;
+    }
+    return 0;
+}
+
+/* Run the state machine of c until it blocks or closes */
+static void conn_drive(conn_t *c)
+{
+    int rc;
+
+    trace_use(&c->trace);
+    do
+    {
+        switch (c->state)
+        {
+        case ST_REQUEST:
+            rc = on_request(c);
+            break;
+        case ST_HIT:
+            rc = on_hit(c);
+            break;
+        case ST_RESOLVE:
+            rc = on_resolve(c);
+            break;
+        case ST_CONNECT:
+            rc = on_connect(c);
+            break;
+        case ST_FORWARD:
+            rc = on_forward(c);
+            break;
+        case ST_RELAY:
+            rc = on_relay(c);
+            break;
+        case ST_FOLLOW:
+            rc = on_follow(c);
+            break;
+        case ST_ESTABLISH:
+            rc = on_establish(c);
+            break;
+        case ST_TUNNEL:
+            rc = on_tunnel(c);
+            break;
+        default:
+            rc = DRIVE_CLOSE;
+        }
+    } while (rc == DRIVE_NEXT);
+
+    if (rc == DRIVE_CLOSE)
+        conn_close(c);
+    trace_use(NULL);
+}
+
+/* Release everything but the conn itself, which is freed after the batch */
+static void conn_close(conn_t *c)
+{
+    count_request(c);
+    if (c->state == ST_TUNNEL)
+        stats_tunnel(-1);
+    else if (c->accepted)
+        stats_connection(-1);
+    if (c->client.fd >= 0)
+        Close(c->client.fd);
+    if (c->server.fd >= 0)
+        Close(c->server.fd);
+    if (c->query)
+        c->addrs = end_query(c);
+    if (c->addrs)
+        dns_release(c->addrs);
+    ebuf_free(&c->in);
+    ebuf_free(&c->up);
+    ebuf_free(&c->down);
+    tpipe_close(&c->up_pipe);
+    tpipe_close(&c->down_pipe);
+    if (c->cache_buf)
+        Free(c->cache_buf);
+    if (c->hit)
+        cache_release(c->hit);
+    if (c->dhit.seg)
+        disk_release(&c->dhit);
+    if (c->plain)
+        Free(c->plain);
+    if (c->dw)
+        disk_commit(c->dw, 0);
+    drop_flight(c);
+    if (c->hostname)
+        Free(c->hostname);
+    if (c->port)
+        Free(c->port);
+    if (c->uri)
+        Free(c->uri);
+    if (c->lprev)
+        c->lprev->lnext = c->lnext;
+    else
+        c->loop->conns = c->lnext;
+    if (c->lnext)
+        c->lnext->lprev = c->lprev;
+    c->closed = 1;
+    c->next = c->loop->dead;
+    c->loop->dead = c;
+}
+
+/* The response is sent: wait for the next request or close */
+static int conn_next(conn_t *c)
+{
+    count_request(c);
+    if (!c->keep)
+        return DRIVE_CLOSE;
+
+    if (c->server.fd >= 0)
+    {
+        Close(c->server.fd);
+        c->server.fd = -1;
+    }
+    if (c->hit)
+    {
+        cache_release(c->hit);
+        c->hit = NULL;
+    }
+    if (c->dhit.seg)
+        disk_release(&c->dhit);
+    if (c->plain)
+    {
+        Free(c->plain);
+        c->plain = NULL;
+    }
+    if (c->dw)
+    {
+        disk_commit(c->dw, 0);
+        c->dw = NULL;
+    }
+    drop_flight(c);
+    if (c->cache_buf)
+    {
+        Free(c->cache_buf);
+        c->cache_buf = NULL;
+    }
+    if (c->hostname)
+    {
+        Free(c->hostname);
+        Free(c->port);
+        c->hostname = c->port = NULL;
+    }
+    if (c->uri)
+    {
+        Free(c->uri);
+        c->uri = NULL;
+    }
+    req_init(&c->req);
+    ebuf_free(&c->up);
+    ebuf_free(&c->down);
+    c->obj = NULL;
+    c->obj_size = 0;
+    c->hit_off = 0;
+    c->hit_sent = 0;
+    c->totallen = 0;
+    c->reused = 0;
+    c->head_done = 0;
+    c->begun = 0;
+    c->idle_since = time(NULL);
+    c->state = ST_REQUEST;
+    return DRIVE_NEXT;
+}
+
+/* Count the request c served, if any, as it is done with */
+static void count_request(conn_t *c)
+{
+    long bytes = c->totallen;
+
+    if (c->outcome == STATS_HIT || c->outcome == STATS_REVALIDATED)
+    {
+        bytes = c->hit_sent;
+        if (c->hit)
+            cache_served(c->hit, bytes);
+        else
+            cache_missed(bytes);
+    }
+    else if (c->outcome == STATS_COALESCED)
+        bytes = c->flight ? c->flight->head_size + c->cursor.sent : 0;
+    stats_request(c->outcome, c->started, bytes);
+    trace_use(&c->trace);
+    trace_end(c->outcome, bytes, c->uri);
+    c->outcome = STATS_NONE;
+}
+
+/* Read request line and headers, then dispatch the request */
+static int on_request(conn_t *c)
+{
+    char hostname[REQ_HOST], port[REQ_PORT];
+    http_req *req = &c->req;
+    size_t len;
+    int rc;
+
+    if (!c->begun && c->in.len)         /* pipelined */
+        c->begun = stats_now();
+    while ((rc = req_parse(req, c->in.data, c->in.len)) == REQ_MORE)
+    {
+        if (c->in.len >= MAX_REQUEST)
+            return DRIVE_CLOSE;
+        rc = ebuf_read(c->client.fd, &c->in, MAX_REQUEST - c->in.len);
+        if (rc == 0)
+            return DRIVE_BLOCK;
+        if (rc < 0)
+            return DRIVE_CLOSE;
+        if (!c->begun)
+            c->begun = stats_now();
+    }
+    if (rc != REQ_DONE ||
+        str_copy(hostname, sizeof(hostname), req->host) < 0 ||
+        str_copy(port, sizeof(port), req->port) < 0)
+        return DRIVE_CLOSE;
+    dbg_printf("%.*s %.*s\n", (int)req->method.len, req->method.p,
+               (int)req->uri.len, req->uri.p);
+    c->keep = req->keepalive && ++c->nrequests < client_requests;
+    c->started = stats_now();
+
+    if (str_is(req->method, "CONNECT"))     /* https request */
+    {
+        /* Bytes the client sent past the headers go to the server */
+        char *rest = c->in.data + req->len;
+        size_t restlen = c->in.len - req->len;
+        if (restlen && ebuf_append(&c->up, rest, restlen) < 0)
+            return DRIVE_CLOSE;
+        ebuf_free(&c->in);
+
+        c->https = 1;
+        return start_connect(c, hostname, port);
+    }
+
+    if (!str_is(req->method, "GET"))        /* Not http request */
+    {
+        printf("Proxy does not implement this method");
+        return DRIVE_CLOSE;
+    }
+    trace_begin(&c->trace, c->begun);
+    trace_mark(TRACE_PARSED);
+
+    /* Our own statistics, never cached; freed along with c->plain */
+    if (stats_is_request(req))
+    {
+        size_t size;
+        char *obj = stats_response(&size);
+        ebuf_consume(&c->in, req->len);
+        rc = start_hit(c, obj, size);
+        c->plain = obj;
+        return rc;
+    }
+
+    /* Serve http request, from the cache first */
+    if (!(c->uri = strndup(req->uri.p, req->uri.len)))
+        return DRIVE_CLOSE;
+    int fresh = 0;
+    if ((c->hit = cache_read(c->uri)))
+    {
+        fresh = cache_fresh(c->hit);
+        c->obj = c->hit->cache_obj;
+        c->obj_size = c->hit->object_size;
+    }
+    else if (disk_read(c->uri, &c->dhit) == 0)
+    {
+        fresh = c->dhit.expires > time(NULL);
+        c->obj = c->dhit.data;
+        c->obj_size = c->dhit.size;
+    }
+    trace_mark(TRACE_LOOKUP);
+
+    /* A stale copy is revalidated, unless it has nothing to ask with */
+    char cond[RESP_CONDITIONAL];
+    if (c->obj && !fresh &&
+        !resp_conditional(c->obj, resp_head_size(c->obj, c->obj_size),
+                          cond, sizeof(cond)))
+        drop_stale(c);
+    if (!fresh)
+    {
+        if (ebuf_reserve(&c->up, MAX_UPSTREAM) < 0 ||
+            !(len = build_request(req, c->up.data + c->up.len,
+                                  c->obj ? cond : NULL)))
+            return DRIVE_CLOSE;
+        c->up.len += len;
+        c->up.data[c->up.len] = '\0';
+    }
+    ebuf_consume(&c->in, req->len);     /* a pipelined request may follow */
+
+    if (fresh)
+    {
+        c->outcome = STATS_HIT;
+        return start_hit(c, c->obj, c->obj_size);
+    }
+
+    c->hostname = strdup(hostname);
+    c->port = strdup(port);
+    if (!c->hostname || !c->port)
+        return DRIVE_CLOSE;
+    if (c->obj)
+        return start_miss(c);
+
+    /* Someone is fetching it already: relay that response instead */
+    c->flight = flight_join(c->uri, &c->leader);
+    if (c->flight && !c->leader)
+        return start_follow(c);
+    return start_miss(c);
+}
+
+/*
+ * Cached head with our Connection header, then the body in place, or
+ * inflated first for a client that does not take gzip; a byte range the
+ * client asked for is cut out of the identity body
+ */
+static int start_hit(conn_t *c, const char *obj, size_t size)
+{
+    size_t first = 0, last = 0;
+
+    if ((!c->req.gzip || c->req.range) &&
+        (c->plain = encode_plain(obj, size, &size)))
+        obj = c->plain;
+    size_t hsize = resp_head_size(obj, size);
+    int range = req_range(&c->req, obj, hsize, size - hsize, &first, &last);
+
+    dbg_printf("send back, len: %zu\n", size);
+    c->obj = obj;
+    c->obj_size = size;
+    if (!hsize)
+        c->keep = 0;
+    else if (range == RANGE_NONE)
+    {
+        if (ebuf_reserve(&c->down, hsize + RESP_CONN_EXTRA) < 0)
+            return DRIVE_CLOSE;
+        c->down.len += resp_head_conn(c->down.data + c->down.len, obj,
+                                      hsize, c->keep);
+        c->hit_off = hsize;
+    }
+    else
+    {
+        if (ebuf_reserve(&c->down, hsize + RESP_RANGE_EXTRA) < 0)
+            return DRIVE_CLOSE;
+        c->down.len += resp_range_head(c->down.data + c->down.len, obj,
+                                       hsize, range, first, last,
+                                       size - hsize, c->keep);
+        c->hit_off = range == RANGE_PART ? hsize + first : size;
+        c->obj_size = range == RANGE_PART ? hsize + last + 1 : size;
+    }
+    ebuf_free(&c->up);
+    c->state = ST_HIT;
+    return DRIVE_NEXT;
+}
+
+/* Let go of a stored copy that cannot be revalidated */
+static void drop_stale(conn_t *c)
+{
+    if (c->hit)
+    {
+        cache_release(c->hit);
+        c->hit = NULL;
+    }
+    if (c->dhit.seg)
+        disk_release(&c->dhit);
+    c->obj = NULL;
+    c->obj_size = 0;
+}
+
+/* Fetch the response from the end server */
+static int start_miss(conn_t *c)
+{
+    c->outcome = STATS_BYPASS;      /* until the head says otherwise */
+    c->cache_buf = Malloc(MAX_OBJECT_SIZE);
+    return start_upstream(c);
+}
+
+/* Follow the flight of c->uri, woken up by its eventfd */
+static int start_follow(conn_t *c)
+{
+    c->outcome = STATS_COALESCED;
+    c->notify.fd = flight_notify_fd(c->flight);
+    if (c->notify.fd < 0)
+    {
+        drop_flight(c);
+        return start_miss(c);
+    }
+    if (watch(c->loop, &c->notify) < 0)
+        return DRIVE_CLOSE;
+    c->state = ST_FOLLOW;
+    return DRIVE_NEXT;
+}
+
+/* Leave the flight; a leader that did not finish it makes it fail */
+static void drop_flight(conn_t *c)
+{
+    if (!c->flight)
+        return;
+    if (c->leader)
+        flight_finish(c->flight, 0);
+    if (c->notify.fd >= 0)
+    {
+        Close(c->notify.fd);
+        c->notify.fd = -1;
+    }
+    flight_leave(c->flight, &c->cursor);
+    flight_release(c->flight);
+    c->flight = NULL;
+    c->leader = 0;
+    c->cursor.chunk = NULL;
+    c->cursor.off = 0;
+    c->cursor.sent = 0;
+}
+
+/* Send the head and the cached object, straight from the cache */
+static int on_hit(conn_t *c)
+{
+    /* Head and body together, in one writev() while the socket takes it */
+    while (c->down.off < c->down.len || c->hit_off < c->obj_size)
+    {
+        struct iovec iov[2] = {
+            {c->down.data + c->down.off, c->down.len - c->down.off},
+            {(char *)c->obj + c->hit_off, c->obj_size - c->hit_off},
+        };
+        ssize_t rc = writev(c->client.fd, iov, 2);
+        if (rc < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return DRIVE_BLOCK;
+            return DRIVE_CLOSE;     /* client went away */
+        }
+        size_t head = rc < iov[0].iov_len ? rc : iov[0].iov_len;
+        c->down.off += head;
+        c->hit_off += rc - head;
+        c->hit_sent += rc;
+    }
+    return conn_next(c);
+}
+
+/* Send the request on a pooled connection, or connect to the server */
+static int start_upstream(conn_t *c)
+{
+    int fd = upstream_take(c->hostname, c->port);
+    if (fd < 0)
+        return start_connect(c, c->hostname, c->port);
+    if (set_nonblocking(fd) < 0)
+    {
+        Close(fd);
+        return start_connect(c, c->hostname, c->port);
+    }
+    c->server.fd = fd;
+    c->reused = 1;
+    if (watch(c->loop, &c->server) < 0)
+        return DRIVE_CLOSE;
+    trace_mark(TRACE_CONNECT);
+    c->state = ST_FORWARD;
+    return DRIVE_NEXT;
+}
+
+/* Hand the server connection of a complete response back to the pool */
+static void release_upstream(conn_t *c)
+{
+    int fd = c->server.fd;
+    c->server.fd = -1;
+    if (epoll_ctl(c->loop->epfd, EPOLL_CTL_DEL, fd, NULL) < 0 ||
+        set_blocking(fd) < 0)
+    {
+        Close(fd);
+        return;
+    }
+    upstream_put(c->hostname, c->port, fd);
+}
+
+/*
+ * Look the end server up in the dns cache and start connecting to its
+ * first address; a name not in the cache is left to a resolver thread
+ */
+static int start_connect(conn_t *c, char *hostname, char *port)
+{
+    if ((c->addrs = dns_cached(hostname, port)))
+        return connect_addrs(c);
+    if (!(c->query = dns_query_start(hostname, port)))
+        return DRIVE_CLOSE;
+    c->resolved.fd = dns_query_fd(c->query);
+    if (watch(c->loop, &c->resolved) < 0)
+        return DRIVE_CLOSE;
+    c->state = ST_RESOLVE;
+    return DRIVE_NEXT;
+}
+
+/* Connect to the end server once its addresses are known */
+static int on_resolve(conn_t *c)
+{
+    if (!dns_query_done(c->query))
+        return DRIVE_BLOCK;
+    c->addrs = end_query(c);
+    return connect_addrs(c);
+}
+
+/* Stop waiting for the resolution of c, return its result if any */
+static dns_addrs *end_query(conn_t *c)
+{
+    /* The resolver may write the eventfd after the conn is freed */
+    epoll_ctl(c->loop->epfd, EPOLL_CTL_DEL, c->resolved.fd, NULL);
+    dns_addrs *addrs = dns_query_end(c->query);
+    c->query = NULL;
+    c->resolved.fd = -1;
+    return addrs;
+}
+
+/* Start connecting to the first address of c->addrs */
+static int connect_addrs(conn_t *c)
+{
+    if (!c->addrs || c->addrs->err)
+        return DRIVE_CLOSE;
+    trace_mark(TRACE_DNS);
+    c->ai_cur = c->addrs->list;
+    c->state = ST_CONNECT;
+    return try_connect(c);
+}
+
+/* Start a non-blocking connect to c->ai_cur or any later address */
+static int try_connect(conn_t *c)
+{
+    for (; c->ai_cur; c->ai_cur = c->ai_cur->ai_next)
+    {
+        struct addrinfo *p = c->ai_cur;
+        int fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (fd < 0)
+            continue;
+        if (set_nonblocking(fd) < 0)
+        {
+            close(fd);
+            continue;
+        }
+        if (connect(fd, p->ai_addr, p->ai_addrlen) < 0 &&
+            errno != EINPROGRESS)
+        {
+            close(fd);
+            continue;
+        }
+        c->server.fd = fd;
+        if (watch(c->loop, &c->server) < 0)
+            return DRIVE_CLOSE;
+        return DRIVE_NEXT;
+    }
+    printf("connection failed\n");
+    return DRIVE_CLOSE;
+}
+
+/* Wait for the pending connect, falling back to the next address */
+static int on_connect(conn_t *c)
+{
+    struct addrinfo *p = c->ai_cur;
+    if (connect(c->server.fd, p->ai_addr, p->ai_addrlen) < 0 &&
+        errno != EISCONN)
+    {
+        if (errno == EALREADY || errno == EINPROGRESS)
+            return DRIVE_BLOCK;
+        Close(c->server.fd);
+        c->server.fd = -1;
+        c->ai_cur = p->ai_next;
+        return try_connect(c);
+    }
+
+    dns_release(c->addrs);
+    c->addrs = NULL;
+    c->ai_cur = NULL;
+    trace_mark(TRACE_CONNECT);
+    c->state = c->https ? ST_ESTABLISH : ST_FORWARD;
+    if (c->https && ebuf_append(&c->down, https_res, strlen(https_res)) < 0)
+        return DRIVE_CLOSE;
+    return DRIVE_NEXT;
+}
+
+/* Send the request, keeping it in c->up in case it must be sent again */
+static int on_forward(conn_t *c)
+{
+    while (c->up.off < c->up.len)
+    {
+        ssize_t rc = write(c->server.fd, c->up.data + c->up.off,
+                           c->up.len - c->up.off);
+        if (rc < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return DRIVE_BLOCK;
+            if (c->reused)      /* stale pooled connection */
+                break;
+            return DRIVE_CLOSE;
+        }
+        c->up.off += rc;
+    }
+    trace_mark(TRACE_SENT);
+    resp_init(&c->resp);
+    c->state = ST_RELAY;
+    return DRIVE_NEXT;
+}
+
+/* Relay the response to the client, keeping a copy for the cache */
+static int on_relay(conn_t *c)
+{
+    while (1)
+    {
+        int rc = c->head_done ? ebuf_flush(c->client.fd, &c->down) : 1;
+        if (rc == 0)
+            return DRIVE_BLOCK;
+        if (rc < 0)
+            return DRIVE_CLOSE;
+        if (c->resp.state == RESP_DONE || c->resp.state == RESP_ERROR)
+            break;
+
+        size_t before = c->down.len;
+        rc = ebuf_read(c->server.fd, &c->down, MAXLINE);
+        if (rc == 0)
+            return DRIVE_BLOCK;
+        if (rc < 0)
+        {
+            resp_eof(&c->resp);
+
+            /* The server closed the pooled connection meanwhile */
+            if (c->reused && c->totallen == 0 &&
+                c->resp.state == RESP_ERROR)
+            {
+                Close(c->server.fd);
+                c->server.fd = -1;
+                c->reused = 0;
+                c->up.off = 0;
+                ebuf_free(&c->down);
+                return start_connect(c, c->hostname, c->port);
+            }
+            break;
+        }
+
+        if (!c->head_done && !before)
+            trace_mark(TRACE_FIRST);
+
+        /* Bytes past the end of the response: do not reuse */
+        size_t n = c->down.len - before;
+        size_t len = resp_parse(&c->resp, c->down.data + before, n);
+        if (len < n)
+        {
+            c->resp.keepalive = 0;
+            c->down.len = before + len;
+        }
+
+        /* Hold the bytes back until the head can be rewritten */
+        if (!c->head_done)
+        {
+            if (c->resp.state == RESP_HEADERS &&
+                c->resp.header_len <= RESP_HEAD)
+                continue;
+            if (c->resp.state == RESP_ERROR)
+                return DRIVE_CLOSE;
+            if (c->obj && c->resp.status == 304)
+                return not_modified(c);
+            if (relay_head(c) < 0)
+                return DRIVE_CLOSE;
+            continue;
+        }
+
+        c->totallen += len;
+        if (c->totallen <= MAX_OBJECT_SIZE)
+            memcpy(c->cache_buf + (c->totallen - len),
+                   c->down.data + before, len);
+        if (c->flight)
+            flight_append(c->flight, c->down.data + before, len);
+        if (c->dw)
+            disk_append(c->dw, c->down.data + before, len);
+    }
+    dbg_printf("get HTTP response end\n");
+
+    cache_missed(c->totallen);
+    if (c->resp.state != RESP_DONE)
+        return DRIVE_CLOSE;
+    if (c->expires >= 0 && c->totallen <= MAX_OBJECT_SIZE)
+        cache_fill(c->cache_buf, c->uri, c->totallen, c->expires);
+    if (c->flight)
+        flight_finish(c->flight, 1);
+    if (c->dw)
+    {
+        disk_commit(c->dw, 1);
+        c->dw = NULL;
+    }
+    if (c->resp.keepalive)
+        release_upstream(c);
+    return conn_next(c);
+}
+
+/*
+ * The head of the response is complete at the start of c->down: strip it,
+ * add our Connection header and queue it in front of the body bytes read
+ * along with it
+ */
+static int relay_head(conn_t *c)
+{
+    ebuf_t out = {0};
+    size_t headlen = c->resp.header_len;
+    char *body = c->down.data + headlen;
+    size_t bodylen = c->down.len - headlen;
+
+    if (headlen > RESP_HEAD)
+        return -1;
+    headlen = resp_strip_head(c->down.data, headlen);
+    c->keep = c->keep && c->resp.state != RESP_BODY_EOF;
+    c->expires = fresh_until(c->down.data, headlen);
+    c->outcome = c->expires >= 0 ? STATS_MISS : STATS_BYPASS;
+    if (ebuf_reserve(&out, headlen + RESP_CONN_EXTRA + bodylen) < 0)
+        return -1;
+    out.len = resp_head_conn(out.data, c->down.data, headlen, c->keep);
+    ebuf_append(&out, body, bodylen);
+
+    c->totallen = headlen + bodylen;
+    if (c->totallen <= MAX_OBJECT_SIZE)
+    {
+        memcpy(c->cache_buf, c->down.data, headlen);
+        memcpy(c->cache_buf + headlen, body, bodylen);
+    }
+    if (c->flight && c->expires < 0)
+        flight_finish(c->flight, 0);    /* followers fetch it themselves */
+    else if (c->flight)
+    {
+        flight_head(c->flight, c->down.data, headlen,
+                    c->resp.state != RESP_BODY_EOF);
+        flight_append(c->flight, body, bodylen);
+    }
+    if (c->resp.state == RESP_BODY_LENGTH && c->expires >= 0 &&
+        (c->dw = disk_reserve(c->uri, headlen + c->resp.content_length,
+                              c->expires)))
+    {
+        disk_append(c->dw, c->down.data, headlen);
+        disk_append(c->dw, body, bodylen);
+    }
+    ebuf_free(&c->down);
+    c->down = out;
+    c->head_done = 1;
+    return 0;
+}
+
+/*
+ * The end server answered 304 to the revalidation of c->obj, whose head
+ * is at the start of c->down: refresh the stored copy and send it
+ */
+static int not_modified(conn_t *c)
+{
+    size_t headlen = resp_strip_head(c->down.data, c->resp.header_len);
+    long expires = refresh_until(c->down.data, headlen, c->obj, c->obj_size);
+
+    if (c->hit)
+        cache_refresh(c->hit, expires);
+    else
+        disk_refresh(c->uri, expires);
+    if (c->resp.keepalive)
+        release_upstream(c);
+    ebuf_free(&c->down);
+    c->outcome = STATS_REVALIDATED;
+    return start_hit(c, c->obj, c->obj_size);
+}
+
+/* Relay the flight as it arrives, body bytes straight from its chunks */
+static int on_follow(conn_t *c)
+{
+    flight *f = c->flight;
+    const char *buf;
+    size_t n;
+
+    while (1)
+    {
+        int rc = ebuf_flush(c->client.fd, &c->down);
+        if (rc == 0)
+            return DRIVE_BLOCK;
+        if (rc < 0)
+            return DRIVE_CLOSE;
+
+        if (!c->head_done)
+        {
+            rc = flight_wait_head(f, 0);
+            if (rc < 0)
+                return DRIVE_BLOCK;
+            if (rc == 0)            /* failed early, fetch it ourselves */
+            {
+                drop_flight(c);
+                return start_miss(c);
+            }
+            trace_mark(TRACE_FIRST);
+            c->keep = c->keep && f->framed;
+            if (ebuf_reserve(&c->down, f->head_size + RESP_CONN_EXTRA) < 0)
+                return DRIVE_CLOSE;
+            c->down.len += resp_head_conn(c->down.data + c->down.len,
+                                          f->head, f->head_size, c->keep);
+            c->head_done = 1;
+            continue;
+        }
+
+        rc = flight_read(f, &c->cursor, &buf, &n, 0);
+        if (rc < 0)
+            return DRIVE_BLOCK;
+        if (rc == 0)
+            break;
+        ssize_t w = write(c->client.fd, buf, n);
+        if (w < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return DRIVE_BLOCK;
+            return DRIVE_CLOSE;
+        }
+        c->cursor.off += w;
+        c->cursor.sent += w;
+    }
+
+    cache_missed(f->head_size + c->cursor.sent);
+    if (f->state != FLIGHT_DONE)
+        return DRIVE_CLOSE;
+    return conn_next(c);
+}
+
+static int on_establish(conn_t *c)
+{
+    int rc = ebuf_flush(c->client.fd, &c->down);
+    if (rc == 0)
+        return DRIVE_BLOCK;
+    if (rc < 0)
+        return DRIVE_CLOSE;
+    if (tunnel_splice)          /* copying if a pipe cannot be opened */
+    {
+        tpipe_open(&c->up_pipe);
+        tpipe_open(&c->down_pipe);
+    }
+    c->state = ST_TUNNEL;
+    c->accepted = 0;        /* a tunnel from now on */
+    stats_connection(-1);
+    stats_tunnel(1);
+    return DRIVE_NEXT;
+}
+
+/* Relay both directions until each side has shut down its end */
+static int on_tunnel(conn_t *c)
+{
+    c->idle_since = time(NULL);
+    if (tunnel_dir(c->client.fd, c->server.fd, &c->up, &c->up_pipe,
+                   &c->up_eof) < 0 ||
+        tunnel_dir(c->server.fd, c->client.fd, &c->down, &c->down_pipe,
+                   &c->down_eof) < 0)
+        return DRIVE_CLOSE;
+    if (c->up_eof && c->down_eof)
+        return DRIVE_CLOSE;
+    return DRIVE_BLOCK;
+}
+
+/*
+ * One direction of a tunnel: bytes read before the tunnel was set up go
+ * out of b first, then everything moves through the pipe p, or through b
+ * if splice is not available
+ */
+static int tunnel_dir(int srcfd, int dstfd, ebuf_t *b, tunnel_pipe *p,
+                      int *eof)
+{
+    if (p->fds[0] >= 0)
+    {
+        int rc = ebuf_flush(dstfd, b);
+        if (rc <= 0)
+            return rc;
+        rc = tpipe_pump(srcfd, dstfd, p, eof);
+        if (rc != TUNNEL_UNSUPPORTED)
+            return rc;
+        tpipe_close(p);
+    }
+    return pump(srcfd, dstfd, b, eof);
+}
+
+/*
+ * Move bytes from srcfd to dstfd through b until one side would block;
+ * once srcfd reaches EOF and b drains, pass the half-close on to dstfd.
+ * Returns -1 on error.
+ */
+static int pump(int srcfd, int dstfd, ebuf_t *b, int *eof)
+{
+    while (1)
+    {
+        int rc = ebuf_flush(dstfd, b);
+        if (rc <= 0)
+            return rc;
+        if (*eof)
+            return 0;
+        rc = ebuf_read(srcfd, b, MAXLINE);
+        if (rc == 0)
+            return 0;
+        if (rc < 0)
+        {
+            *eof = 1;
+            shutdown(dstfd, SHUT_WR);
+            return 0;
+        }
+    }
+}
+
+/*
+ * Buffer helpers.  ebuf_read returns 1 if data was read, 0 if it would
+ * block and -1 on EOF or error; ebuf_flush returns 1 once everything is
+ * written, 0 if it would block and -1 on error.
+ */
+static int ebuf_reserve(ebuf_t *b, size_t n)
+{
+    if (b->off == b->len)
+        b->off = b->len = 0;
+    if (b->len + n + 1 <= b->cap)
+        return 0;
+    size_t cap = b->cap ? b->cap : MAXLINE;
+    while (cap < b->len + n + 1)
+        cap *= 2;
+    char *data = realloc(b->data, cap);
+    if (!data)
+        return -1;
+    b->data = data;
+    b->data[b->len] = '\0';
+    b->cap = cap;
+    return 0;
+}
+
+static int ebuf_append(ebuf_t *b, const char *s, size_t n)
+{
+    if (ebuf_reserve(b, n) < 0)
+        return -1;
+    memcpy(b->data + b->len, s, n);
+    b->len += n;
+    b->data[b->len] = '\0';
+    return 0;
+}
+
+static int ebuf_read(int fd, ebuf_t *b, size_t n)
+{
+    if (ebuf_reserve(b, n) < 0)
+        return -1;
+    while (1)
+    {
+        ssize_t rc = read(fd, b->data + b->len, n);
+        if (rc > 0)
+        {
+            b->len += rc;
+            b->data[b->len] = '\0';
+            return 1;
+        }
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        return -1;
+    }
+}
+
+static int ebuf_flush(int fd, ebuf_t *b)
+{
+    while (b->off < b->len)
+    {
+        ssize_t rc = write(fd, b->data + b->off, b->len - b->off);
+        if (rc < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        b->off += rc;
+    }
+    b->off = b->len = 0;
+    return 1;
+}
+
+/* Drop the first n pending bytes of b */
+static void ebuf_consume(ebuf_t *b, size_t n)
+{
+    b->off += n;
+    memmove(b->data, b->data + b->off, b->len - b->off);
+    b->len -= b->off;
+    b->off = 0;
+    b->data[b->len] = '\0';
+}
+
+static void ebuf_free(ebuf_t *b)
+{
+    if (b->data)
+        Free(b->data);
+    memset(b, 0, sizeof(ebuf_t));
+}
@@ -0,0 +1,348 @@
+/*
+ * flight.c - single-flight coalescing of concurrent cache misses
+ *
+ * The first request that misses the cache for a url becomes the leader
+ * of a flight and fetches the response; requests for the same url that
+ * miss while it is in flight follow it instead of going to the end
+ * server.  The leader publishes the stripped head and then the body in
+ * fixed chunks, and followers relay them to their clients as they arrive.
+ *
+ * Threaded followers wait on the condition variable of the flight.  The
+ * event loops cannot block, so their followers watch a duplicate of the
+ * eventfd of the flight, which the leader writes on every progress.
+ *
+ * A flight leaves the table when it ends, or once its body outgrows
+ * MAX_OBJECT_SIZE: such a response is not cached and nothing is gained by
+ * letting new requests wait for it.  From then on the set of followers
+ * only shrinks, so a chunk every one of them is past is freed, and a
+ * flight left with no follower keeps no body at all: a large download
+ * holds a few chunks, not its whole size.  The rest of the memory of a
+ * flight is released with its last reference.
+ */
+#include "csapp.h"
+#include "proxy.h"
+#include "cache.h"
+#include "flight.h"
+#include <sys/eventfd.h>
+
+#define FLIGHT_BUCKETS 256      /* hash buckets of in-flight urls */
+
+static flight *buckets[FLIGHT_BUCKETS];
+static sem_t table_mutex;       /* Protection for buckets and listed */
+
+static void unlist(flight *f);
+static void progress(flight *f);
+static void trim(flight *f);
+
+void flight_init(void)
+{
+    Sem_init(&table_mutex, 0, 1);
+}
+
+/*
+ * Follow the flight of url, or start one and set *leader; return NULL if
+ * no flight could be started
+ */
+flight *flight_join(char *url, int *leader)
+{
+    unsigned int hash = cache_hash(url);
+    flight **bucket = &buckets[hash % FLIGHT_BUCKETS];
+
+    P(&table_mutex);
+    for (flight *f = *bucket; f; f = f->hnext)
+    {
+        if (f->hash == hash && !strcmp(f->url, url))
+        {
+            __atomic_add_fetch(&f->refcnt, 1, __ATOMIC_RELAXED);
+            V(&table_mutex);
+            *leader = 0;
+            dbg_printf("following flight of %s\n", url);
+            return f;
+        }
+    }
+
+    flight *f = calloc(1, sizeof(flight));
+    if (!f || !(f->url = strdup(url)))
+    {
+        V(&table_mutex);
+        free(f);
+        return NULL;
+    }
+    f->hash = hash;
+    f->refcnt = 1;
+    f->state = FLIGHT_RUNNING;
+    f->efd = -1;
+    pthread_mutex_init(&f->mutex, NULL);
+    pthread_cond_init(&f->cond, NULL);
+    f->listed = 1;
+    f->hnext = *bucket;
+    *bucket = f;
+    V(&table_mutex);
+    *leader = 1;
+    return f;
+}
+
+/* Drop one reference, the last one frees the flight */
+void flight_release(flight *f)
+{
+    if (__atomic_sub_fetch(&f->refcnt, 1, __ATOMIC_ACQ_REL))
+        return;
+
+    flight_chunk *ch = f->first;
+    while (ch)
+    {
+        flight_chunk *next = ch->next;
+        free(ch);
+        ch = next;
+    }
+    if (f->efd >= 0)
+        close(f->efd);
+    pthread_mutex_destroy(&f->mutex);
+    pthread_cond_destroy(&f->cond);
+    free(f->head);
+    free(f->url);
+    free(f);
+}
+
+/* Make the flight unreachable for new requests */
+static void unlist(flight *f)
+{
+    P(&table_mutex);
+    if (f->listed)
+    {
+        flight **pp = &buckets[f->hash % FLIGHT_BUCKETS];
+        while (*pp != f)
+            pp = &(*pp)->hnext;
+        *pp = f->hnext;
+        f->listed = 0;
+    }
+    V(&table_mutex);
+}
+
+/* Wake every follower, with f->mutex held */
+static void progress(flight *f)
+{
+    uint64_t one = 1;
+    pthread_cond_broadcast(&f->cond);
+    if (f->efd >= 0 && write(f->efd, &one, sizeof(one)) < 0 &&
+        errno != EAGAIN)
+        unix_error("eventfd write error");
+}
+
+/* Publish the stripped head of the response */
+void flight_head(flight *f, const char *head, size_t hsize, int framed)
+{
+    char *copy = malloc(hsize);
+    if (!copy)
+    {
+        flight_finish(f, 0);
+        return;
+    }
+    memcpy(copy, head, hsize);
+
+    pthread_mutex_lock(&f->mutex);
+    f->head = copy;
+    f->head_size = hsize;
+    f->framed = framed;
+    progress(f);
+    pthread_mutex_unlock(&f->mutex);
+}
+
+/* Publish n more body bytes */
+void flight_append(flight *f, const char *buf, size_t n)
+{
+    /* Nobody joins once it is too large, before any chunk is freed */
+    if (f->len <= MAX_OBJECT_SIZE && f->len + n > MAX_OBJECT_SIZE)
+        unlist(f);
+
+    pthread_mutex_lock(&f->mutex);
+    if (f->state != FLIGHT_RUNNING)
+    {
+        pthread_mutex_unlock(&f->mutex);
+        return;
+    }
+    if (f->len + n > MAX_OBJECT_SIZE)
+        f->sealed = 1;
+    if (f->sealed && __atomic_load_n(&f->refcnt, __ATOMIC_ACQUIRE) == 1)
+    {
+        trim(f);                    /* no follower left, nor to come */
+        f->len += n;
+        pthread_mutex_unlock(&f->mutex);
+        return;
+    }
+    while (n > 0)
+    {
+        flight_chunk *ch = f->last;
+        if (!ch || ch->len == FLIGHT_CHUNK)
+        {
+            if (!(ch = malloc(sizeof(flight_chunk))))
+            {
+                f->state = FLIGHT_FAILED;   /* followers cannot go on */
+                break;
+            }
+            ch->next = NULL;
+            ch->start = f->len;
+            ch->len = 0;
+            if (f->last)
+                f->last->next = ch;
+            else
+                f->first = ch;
+            f->last = ch;
+        }
+        size_t take = FLIGHT_CHUNK - ch->len;
+        if (take > n)
+            take = n;
+        memcpy(ch->data + ch->len, buf, take);
+        ch->len += take;
+        f->len += take;
+        buf += take;
+        n -= take;
+    }
+    trim(f);
+    progress(f);
+    pthread_mutex_unlock(&f->mutex);
+}
+
+/*
+ * Free the chunks of a sealed flight that every follower is past, with
+ * f->mutex held.  A follower that has not read yet starts from the first
+ * chunk, so nothing goes while one has not.
+ */
+static void trim(flight *f)
+{
+    size_t low = f->len;
+
+    if (!f->sealed ||
+        f->nreading < __atomic_load_n(&f->refcnt, __ATOMIC_ACQUIRE) - 1)
+        return;
+    for (flight_cursor *cur = f->cursors; cur; cur = cur->next)
+        if (cur->pos < low)
+            low = cur->pos;
+
+    /* The chunk a cursor points to stays, even when it is read up */
+    while (f->first &&
+           (!f->nreading || f->first->start + FLIGHT_CHUNK < low))
+    {
+        flight_chunk *ch = f->first;
+        f->first = ch->next;
+        free(ch);
+    }
+    if (!f->first)
+        f->last = NULL;
+}
+
+/* The leader is done with the response, successfully or not */
+void flight_finish(flight *f, int ok)
+{
+    unlist(f);
+    pthread_mutex_lock(&f->mutex);
+    if (f->state == FLIGHT_RUNNING)
+        f->state = ok && f->head ? FLIGHT_DONE : FLIGHT_FAILED;
+    progress(f);
+    pthread_mutex_unlock(&f->mutex);
+}
+
+/*
+ * A descriptor of the follower's own that becomes readable on every
+ * progress of the flight, -1 on error
+ */
+int flight_notify_fd(flight *f)
+{
+    int fd = -1;
+    pthread_mutex_lock(&f->mutex);
+    if (f->efd < 0)
+        f->efd = eventfd(0, EFD_NONBLOCK);
+    if (f->efd >= 0)
+        fd = dup(f->efd);
+    pthread_mutex_unlock(&f->mutex);
+    return fd;
+}
+
+/*
+ * Wait for the head: return 1 once f->head may be used, 0 if the flight
+ * failed without one and -1 if it would block
+ */
+int flight_wait_head(flight *f, int block)
+{
+    int rc;
+    pthread_mutex_lock(&f->mutex);
+    while (!f->head && f->state == FLIGHT_RUNNING && block)
+        pthread_cond_wait(&f->cond, &f->mutex);
+    if (f->head)
+        rc = 1;
+    else
+        rc = f->state == FLIGHT_RUNNING ? -1 : 0;
+    pthread_mutex_unlock(&f->mutex);
+    return rc;
+}
+
+/*
+ * Find the body bytes at cur: return 1 with them in *buf and *n (the
+ * caller moves cur->off past what it used), 0 at the end of the flight
+ * and -1 if it would block
+ */
+int flight_read(flight *f, flight_cursor *cur, const char **buf,
+                size_t *n, int block)
+{
+    int rc;
+    pthread_mutex_lock(&f->mutex);
+    if (!cur->reading)
+    {
+        cur->reading = 1;
+        cur->pos = 0;
+        cur->next = f->cursors;
+        f->cursors = cur;
+        ++f->nreading;
+    }
+    while (1)
+    {
+        flight_chunk *ch = cur->chunk ? cur->chunk : f->first;
+        if (ch && cur->off == FLIGHT_CHUNK && ch->next)
+        {
+            ch = ch->next;
+            cur->off = 0;
+        }
+        cur->chunk = ch;
+        if (ch && cur->pos != ch->start + cur->off)
+        {
+            cur->pos = ch->start + cur->off;
+            trim(f);
+        }
+        if (ch && cur->off < ch->len)
+        {
+            *buf = ch->data + cur->off;
+            *n = ch->len - cur->off;
+            rc = 1;
+            break;
+        }
+        if (f->state != FLIGHT_RUNNING)
+        {
+            rc = 0;
+            break;
+        }
+        if (!block)
+        {
+            rc = -1;
+            break;
+        }
+        pthread_cond_wait(&f->cond, &f->mutex);
+    }
+    pthread_mutex_unlock(&f->mutex);
+    return rc;
+}
+
+/* The follower at cur stops reading, before it lets go of the flight */
+void flight_leave(flight *f, flight_cursor *cur)
+{
+    if (!cur->reading)
+        return;
+    pthread_mutex_lock(&f->mutex);
+    flight_cursor **pp = &f->cursors;
+    while (*pp != cur)
+        pp = &(*pp)->next;
+    *pp = cur->next;
+    --f->nreading;
+    cur->reading = 0;
+    trim(f);
+    pthread_mutex_unlock(&f->mutex);
+}
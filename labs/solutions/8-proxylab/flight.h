@@ -0,0 +1,80 @@
+/*
+ * flight.h - single-flight coalescing of concurrent cache misses
+ */
+#ifndef __FLIGHT_H__
+#define __FLIGHT_H__
+
+#include "csapp.h"
+
+#define FLIGHT_CHUNK 16384      /* body bytes per chunk */
+
+/* States of a flight */
+enum
+{
+    FLIGHT_RUNNING,     /* the leader is still receiving the response */
+    FLIGHT_DONE,        /* complete response */
+    FLIGHT_FAILED       /* the leader gave up */
+};
+
+/*
+ * Body chunks never move, so followers read them without copying; once
+ * every follower is past one it is freed
+ */
+typedef struct flight_chunk
+{
+    struct flight_chunk *next;
+    size_t start;               /* offset of data in the body */
+    size_t len;                 /* bytes published so far */
+    char data[FLIGHT_CHUNK];
+} flight_chunk;
+
+/* How far a follower got through the body */
+typedef struct flight_cursor
+{
+    flight_chunk *chunk;
+    size_t off;                 /* in chunk */
+    size_t sent;                /* body bytes moved past, in all */
+    size_t pos;                 /* body offset when last read, for trim */
+    int reading;                /* in the list of the flight */
+    struct flight_cursor *next;
+} flight_cursor;
+
+/* A response being fetched once for every client asking for url */
+typedef struct flight
+{
+    struct flight *hnext;       /* next flight in the same bucket */
+    char *url;
+    unsigned int hash;
+    int listed;                 /* new requests may still join */
+    int refcnt;                 /* the leader and every follower */
+    int state;
+    char *head;                 /* stripped head, NULL until known */
+    size_t head_size;
+    int framed;                 /* body does not end by closing */
+    flight_chunk *first, *last;
+    size_t len;                 /* body bytes published so far */
+    int sealed;                 /* unlisted, no follower may join */
+    flight_cursor *cursors;     /* of the followers reading the body */
+    int nreading;
+    pthread_mutex_t mutex;      /* Protection for everything published */
+    pthread_cond_t cond;        /* Signaled on every progress */
+    int efd;                    /* eventfd written on every progress */
+} flight;
+
+void flight_init(void);
+flight *flight_join(char *url, int *leader);
+void flight_release(flight *f);
+
+/* The leader publishes the response */
+void flight_head(flight *f, const char *head, size_t hsize, int framed);
+void flight_append(flight *f, const char *buf, size_t n);
+void flight_finish(flight *f, int ok);
+
+/* Followers read it */
+int flight_notify_fd(flight *f);
+int flight_wait_head(flight *f, int block);
+int flight_read(flight *f, flight_cursor *cur, const char **buf,
+                size_t *n, int block);
+void flight_leave(flight *f, flight_cursor *cur);
+
+#endif /* __FLIGHT_H__ */
@@ -0,0 +1,1020 @@
+/*
+ * http.c - incremental HTTP message parsing for the proxy
+ *
+ * A request parser is fed the bytes read from a client until the head of
+ * a request is complete.  It goes over every line once, as soon as the
+ * line is complete, and resumes where it stopped on the next call.
+ * Method, uri, version and headers are not copied anywhere: they are
+ * views of the buffer, which must therefore stay in place while the
+ * request is served.  Headers are told apart by their exact name.  The
+ * request for the end server is described as a list of pieces of the
+ * same buffer and of the proxy's own strings, sent with one writev().
+ *
+ * A response parser is fed the bytes of an upstream connection as they
+ * arrive and tells how many of them belong to the current response.  It
+ * follows the framing rules of HTTP/1.1: no body for 1xx, 204 and 304,
+ * otherwise a chunked body, a Content-Length body, or a body delimited
+ * by the end of the connection.  Only the last kind makes the connection
+ * unusable for another request.
+ *
+ * The Connection header is hop-by-hop: the head of a response is stored
+ * and relayed without the one of the end server, and every client gets
+ * its own, telling whether its connection stays open.
+ *
+ * Whether a response may be cached, and for how long it is fresh, comes
+ * from its stored head: Cache-Control, Pragma, Expires, Date, Age and the
+ * status code, as a shared cache reads them.  Its ETag and Last-Modified
+ * date are sent back as If-None-Match and If-Modified-Since once it is
+ * stale.  The conditional headers of clients are not forwarded: the
+ * proxy always fetches complete objects, which it can cache.  Neither is
+ * their Accept-Encoding: the proxy asks for the identity coding and
+ * compresses objects itself (see encode.c), so the only Vary it can
+ * serve from one stored object is Vary: Accept-Encoding.  Nor is Range:
+ * the proxy caches whole objects and cuts the byte range a client asks
+ * for out of the stored body, honoring If-Range (see req_range).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#include "http.h"
+
+static void resp_line(http_resp *r);
+static void resp_header(http_resp *r, char *name, char *value);
+static int req_line(http_req *r, const char *p, size_t len);
+static int req_uri(http_req *r);
+static int req_header_line(http_req *r, const char *p, size_t len);
+static void piece(struct iovec *iov, int *n, const char *p, size_t len);
+static int is_hop_header(const char *line);
+static int only_token(const char *value, size_t n, const char *token);
+static int accepts_coding(const char *value, size_t n, const char *coding);
+static long cc_seconds(const char *value, size_t n, const char *name);
+static long delta_seconds(const char *p, const char *end);
+static int range_spec(const char *p, size_t n, long *first, long *last);
+static long http_date(const char *p, size_t n);
+
+/* Request headers with a meaning to the proxy, by exact name */
+static const struct
+{
+    const char *name;
+    size_t len;
+    int id;
+} known_headers[] = {
+    {"Host", 4, HDR_HOST},
+    {"User-Agent", 10, HDR_USER_AGENT},
+    {"Connection", 10, HDR_CONNECTION},
+    {"Proxy-Connection", 16, HDR_PROXY_CONNECTION},
+    {"Keep-Alive", 10, HDR_KEEP_ALIVE},
+    {"If-None-Match", 13, HDR_IF_NONE_MATCH},
+    {"If-Modified-Since", 17, HDR_IF_MODIFIED_SINCE},
+    {"Accept-Encoding", 15, HDR_ACCEPT_ENCODING},
+    {"Range", 5, HDR_RANGE},
+    {"If-Range", 8, HDR_IF_RANGE},
+};
+
+/* Status codes a cache may keep without being told so */
+static const int cacheable_status[] = {200, 203, 204, 300, 301, 308,
+                                       404, 405, 410, 414, 501};
+
+#define IS_BLANK(c) ((c) == ' ' || (c) == '\t')
+
+void resp_init(http_resp *r)
+{
+    r->state = RESP_HEADERS;
+    r->status = 0;
+    r->keepalive = 0;
+    r->content_length = -1;
+    r->chunked = 0;
+    r->remaining = 0;
+    r->header_len = 0;
+    r->linelen = 0;
+}
+
+/*
+ * Feed n bytes of the connection to r, return how many of them belong to
+ * the response; parsing stops once r->state is RESP_DONE or RESP_ERROR
+ */
+size_t resp_parse(http_resp *r, const char *buf, size_t n)
+{
+    size_t i = 0;
+    while (i < n && r->state != RESP_DONE && r->state != RESP_ERROR)
+    {
+        if (r->state == RESP_BODY_EOF)
+            return n;
+
+        if (r->state == RESP_BODY_LENGTH || r->state == RESP_CHUNK_DATA)
+        {
+            size_t take = n - i;
+            if (take > r->remaining)
+                take = r->remaining;
+            i += take;
+            r->remaining -= take;
+            if (r->remaining == 0)
+                r->state = r->state == RESP_BODY_LENGTH ? RESP_DONE
+                                                        : RESP_CHUNK_CRLF;
+            continue;
+        }
+
+        /* Line-oriented states: collect up to the next '\n' */
+        const char *nl = memchr(buf + i, '\n', n - i);
+        size_t take = nl ? nl + 1 - (buf + i) : n - i;
+        if (r->linelen + take >= RESP_LINE)
+        {
+            r->state = RESP_ERROR;
+            break;
+        }
+        memcpy(r->line + r->linelen, buf + i, take);
+        r->linelen += take;
+        if (r->state == RESP_HEADERS)
+            r->header_len += take;
+        i += take;
+        if (nl)
+        {
+            r->line[r->linelen] = '\0';
+            r->linelen = 0;
+            resp_line(r);
+        }
+    }
+    return i;
+}
+
+/* The connection reached EOF */
+void resp_eof(http_resp *r)
+{
+    r->keepalive = 0;
+    if (r->state == RESP_BODY_EOF)
+        r->state = RESP_DONE;
+    else if (r->state != RESP_DONE)
+        r->state = RESP_ERROR;      /* truncated */
+}
+
+void req_init(http_req *r)
+{
+    r->buf = NULL;
+    r->scanned = 0;
+    r->len = 0;
+    r->method.p = NULL;
+    r->method.len = 0;
+    r->keepalive = 0;
+    r->gzip = 0;
+    r->range = 0;
+    r->if_range = 0;
+    r->nheaders = 0;
+}
+
+/*
+ * Parse the first n bytes of buf, which hold the start of a request and
+ * only grow between calls; return REQ_DONE once r->len bytes make up the
+ * complete head, REQ_MORE if it needs more bytes, REQ_ERROR if malformed
+ */
+int req_parse(http_req *r, const char *buf, size_t n)
+{
+    /* The buffer moved: the views are stale, start over */
+    if (r->buf != buf)
+    {
+        req_init(r);
+        r->buf = buf;
+    }
+
+    while (r->scanned < n)
+    {
+        const char *line = buf + r->scanned;
+        const char *nl = memchr(line, '\n', n - r->scanned);
+        if (!nl)
+            return REQ_MORE;
+        size_t len = nl - line;
+        r->scanned += len + 1;
+        if (len && line[len - 1] == '\r')
+            len--;
+
+        if (!r->method.p)
+        {
+            if (len && req_line(r, line, len) < 0)  /* empty lines before */
+                return REQ_ERROR;                   /* it are ignored */
+        }
+        else if (!len)
+        {
+            r->len = r->scanned;
+            return REQ_DONE;
+        }
+        else if (req_header_line(r, line, len) < 0)
+            return REQ_ERROR;
+    }
+    return REQ_MORE;
+}
+
+/* Value of the header called name, NULL if r has none */
+const http_str *req_header(const http_req *r, const char *name)
+{
+    for (int i = 0; i < r->nheaders; ++i)
+    {
+        const http_header *h = &r->headers[i];
+        if (h->name.len == strlen(name) &&
+            !strncasecmp(h->name.p, name, h->name.len))
+            return &h->value;
+    }
+    return NULL;
+}
+
+/*
+ * Describe r as the proxy forwards it in iov, which has room for
+ * REQ_IOV(number of own headers) pieces: the request line with the path
+ * only, Host from the uri, the own headers (each ending with CRLF), then
+ * the headers of the client the proxy does not replace; return the number
+ * of pieces.  Client headers next to each other in the buffer make one.
+ */
+int req_iov(const http_req *r, struct iovec *iov, const char *const *own)
+{
+    int n = 0;
+
+    piece(iov, &n, "GET ", 4);
+    piece(iov, &n, r->path.p, r->path.len);
+    piece(iov, &n, " HTTP/1.1\r\nHost: ", 17);
+    piece(iov, &n, r->host.p, r->host.len);
+    piece(iov, &n, "\r\n", 2);
+    for (; *own; ++own)
+        piece(iov, &n, *own, strlen(*own));
+    for (int i = 0; i < r->nheaders; ++i)
+    {
+        const http_header *h = &r->headers[i];
+        if (h->id != HDR_OTHER)
+            continue;
+        if (h->line.p[h->line.len] == '\r')      /* CRLF: take it along */
+            piece(iov, &n, h->line.p, h->line.len + 2);
+        else
+        {
+            piece(iov, &n, h->line.p, h->line.len);
+            piece(iov, &n, "\r\n", 2);
+        }
+    }
+    piece(iov, &n, "\r\n", 2);
+    return n;
+}
+
+/*
+ * Write r as the proxy forwards it (see req_iov) into out; return the
+ * size of the request, 0 if it does not fit in size bytes
+ */
+size_t req_rewrite(const http_req *r, char *out, size_t size,
+                   const char *const *own)
+{
+    int nown = 0;
+    while (own[nown])
+        nown++;
+
+    struct iovec iov[REQ_IOV(nown)];
+    int n = req_iov(r, iov, own);
+    size_t len = 0;
+
+    for (int i = 0; i < n; ++i)
+    {
+        if (len + iov[i].iov_len > size)
+            return 0;
+        memcpy(out + len, iov[i].iov_base, iov[i].iov_len);
+        len += iov[i].iov_len;
+    }
+    return len;
+}
+
+/* Whether s holds exactly cstr */
+int str_is(http_str s, const char *cstr)
+{
+    return s.len == strlen(cstr) && !memcmp(s.p, cstr, s.len);
+}
+
+/*
+ * Which part of a stored object with the head of hsize bytes and a body
+ * of body bytes answers r: all of it unless r asks for a byte range of a
+ * complete 200 response, with an If-Range validator that matches if any.
+ * A range is clipped to the body, *first and *last set to where it starts
+ * and ends; one that starts past the end cannot be satisfied.
+ */
+int req_range(const http_req *r, const char *head, size_t hsize,
+              size_t body, size_t *first, size_t *last)
+{
+    if (!r->range || !hsize || resp_status(head, hsize) != 200 ||
+        head_header(head, hsize, "Transfer-Encoding").p)
+        return RANGE_NONE;
+
+    /* A strong ETag, or the exact Last-Modified date */
+    if (r->if_range)
+    {
+        int etag = r->validator[0] == '"';
+        http_str v = head_header(head, hsize,
+                                 etag ? "ETag" : "Last-Modified");
+        if (r->if_range < 0 || !str_is(v, r->validator) ||
+            !strncmp(r->validator, "W/", 2))
+            return RANGE_NONE;
+    }
+
+    if (r->range_first < 0)             /* suffix of range_last bytes */
+    {
+        if (!r->range_last || !body)
+            return RANGE_UNSATISFIABLE;
+        *first = body > r->range_last ? body - r->range_last : 0;
+        *last = body - 1;
+        return RANGE_PART;
+    }
+    if (r->range_first >= body)
+        return RANGE_UNSATISFIABLE;
+    *first = r->range_first;
+    *last = r->range_last < 0 || r->range_last >= body ? body - 1
+                                                        : r->range_last;
+    return RANGE_PART;
+}
+
+/* Copy s to out as a C string, return -1 if it needs more than size */
+int str_copy(char *out, size_t size, http_str s)
+{
+    if (s.len >= size)
+        return -1;
+    memcpy(out, s.p, s.len);
+    out[s.len] = '\0';
+    return 0;
+}
+
+/*
+ * Drop interim 1xx responses and the Connection, Proxy-Connection and
+ * Keep-Alive headers from the complete response head of n bytes, in
+ * place; return the new size of the head, which still ends with CRLF
+ */
+size_t resp_strip_head(char *head, size_t n)
+{
+    size_t in = 0, out = 0;
+    while (in < n)
+    {
+        char *nl = memchr(head + in, '\n', n - in);
+        size_t len = nl ? nl + 1 - (head + in) : n - in;
+        int empty = head[in] == '\n' || (len == 2 && head[in] == '\r');
+
+        if (empty && in + len < n)          /* end of an interim response */
+            out = 0;
+        else if (empty)
+        {
+            memcpy(head + out, "\r\n", 2);
+            out += 2;
+        }
+        else if (!is_hop_header(head + in))
+        {
+            memmove(head + out, head + in, len);
+            out += len;
+        }
+        in += len;
+    }
+    return out;
+}
+
+/* Status code of a response head of n bytes, 0 if it has none */
+int resp_status(const char *head, size_t n)
+{
+    const char *sp = memchr(head, ' ', n);
+    if (!sp || head + n - sp < 4 || !isdigit((unsigned char)sp[1]) ||
+        !isdigit((unsigned char)sp[2]) || !isdigit((unsigned char)sp[3]))
+        return 0;
+    return (sp[1] - '0') * 100 + (sp[2] - '0') * 10 + (sp[3] - '0');
+}
+
+/*
+ * Copy the head answering with the range of a stored object (see
+ * req_range) to out, which has RESP_RANGE_EXTRA more bytes of room than
+ * the head of hsize bytes: 206 with the stored headers, Content-Range and
+ * the length of the part, or 416 with the length of the body alone.  Our
+ * Connection header is added as by resp_head_conn; return the size.
+ */
+size_t resp_range_head(char *out, const char *head, size_t hsize, int range,
+                       size_t first, size_t last, size_t body, int keep)
+{
+    const char *p, *end = head + hsize - 2;
+    const char *sp = memchr(head, ' ', hsize);
+    int vlen = sp ? sp - head : 0;
+    size_t len;
+
+    if (range == RANGE_UNSATISFIABLE)
+        return sprintf(out, "%.*s 416 Range Not Satisfiable\r\n"
+                            "Content-Range: bytes */%zu\r\n"
+                            "Content-Length: 0\r\n%s", vlen, head, body,
+                       resp_conn_line(keep));
+
+    len = sprintf(out, "%.*s 206 Partial Content\r\n", vlen, head);
+    p = memchr(head, '\n', hsize) + 1;
+    while (p < end)
+    {
+        const char *nl = memchr(p, '\n', end - p);
+        const char *next = nl ? nl + 1 : end;
+        if (strncasecmp(p, "Content-Length:", 15) &&
+            strncasecmp(p, "Content-Range:", 14))
+        {
+            memcpy(out + len, p, next - p);
+            len += next - p;
+        }
+        p = next;
+    }
+    return len + sprintf(out + len, "Content-Range: bytes %zu-%zu/%zu\r\n"
+                                    "Content-Length: %zu\r\n%s",
+                         first, last, body, last - first + 1,
+                         resp_conn_line(keep));
+}
+
+/* Size of the stripped head a stored object starts with, 0 if none */
+size_t resp_head_size(const char *obj, size_t n)
+{
+    for (size_t i = 0; i + 3 <= n; ++i)
+    {
+        if (!memcmp(obj + i, "\n\r\n", 3))
+            return i + 3;
+    }
+    return 0;
+}
+
+/*
+ * Copy the stripped head of hsize bytes to out (which may be head itself
+ * and has RESP_CONN_EXTRA more bytes of room), announcing whether the
+ * client connection stays open; return the size of the copy
+ */
+size_t resp_head_conn(char *out, const char *head, size_t hsize, int keep)
+{
+    const char *conn = resp_conn_line(keep);
+    size_t len = strlen(conn);
+    memmove(out, head, hsize - 2);
+    memcpy(out + hsize - 2, conn, len);
+    return hsize - 2 + len;
+}
+
+/*
+ * What follows the stripped head without its final CRLF: our Connection
+ * header and the end of the head
+ */
+const char *resp_conn_line(int keep)
+{
+    return keep ? "Connection: keep-alive\r\n\r\n"
+                : "Connection: close\r\n\r\n";
+}
+
+/*
+ * Tell from the stored head of n bytes, received at now, whether a shared
+ * cache may keep the response and how long it is fresh.  Without max-age
+ * or Expires, that is a tenth of the time since its Last-Modified date,
+ * at most RESP_HEURISTIC_MAX seconds, or else fallback seconds.
+ */
+void resp_cache(const char *head, size_t n, long now, long fallback,
+                http_cache *c)
+{
+    const char *p = head, *end = head + n;
+    long max_age = -1, s_maxage = -1, expires = -1, date = -1, modified = -1;
+    int status = 0, no_store = 0, no_cache = 0, has_cc = 0, pragma = 0;
+    int has_expires = 0;
+
+    memset(c, 0, sizeof(http_cache));
+    while (p < end)
+    {
+        const char *nl = memchr(p, '\n', end - p);
+        const char *next = nl ? nl + 1 : end;
+        size_t len = (nl ? nl : end) - p;
+        if (len && p[len - 1] == '\r')
+            len--;
+
+        const char *colon = memchr(p, ':', len), *v, *vend = p + len;
+        if (p == head)              /* status line */
+        {
+            status = resp_status(p, len);
+            p = next;
+            continue;
+        }
+        if (!colon)
+        {
+            p = next;
+            continue;
+        }
+        for (v = colon + 1; v < vend && IS_BLANK(*v); ++v)
+            ;
+        size_t vlen = vend - v, nlen = colon - p;
+
+        if (nlen == 13 && !strncasecmp(p, "Cache-Control", 13))
+        {
+            has_cc = 1;
+            no_store |= has_token(v, vlen, "no-store") ||
+                        has_token(v, vlen, "private");
+            no_cache |= has_token(v, vlen, "no-cache");
+            if (cc_seconds(v, vlen, "max-age") >= 0)
+                max_age = cc_seconds(v, vlen, "max-age");
+            if (cc_seconds(v, vlen, "s-maxage") >= 0)
+                s_maxage = cc_seconds(v, vlen, "s-maxage");
+        }
+        else if (nlen == 6 && !strncasecmp(p, "Pragma", 6))
+            pragma |= has_token(v, vlen, "no-cache");
+        else if (nlen == 7 && !strncasecmp(p, "Expires", 7))
+        {
+            has_expires = 1;
+            expires = http_date(v, vlen);   /* invalid means expired */
+        }
+        else if (nlen == 4 && !strncasecmp(p, "Date", 4))
+            date = http_date(v, vlen);
+        else if (nlen == 13 && !strncasecmp(p, "Last-Modified", 13))
+        {
+            modified = http_date(v, vlen);
+            c->validators = 1;
+        }
+        else if (nlen == 4 && !strncasecmp(p, "ETag", 4))
+            c->validators = 1;
+        else if (nlen == 4 && !strncasecmp(p, "Vary", 4))
+            no_store |= !only_token(v, vlen, "Accept-Encoding");
+        else if (nlen == 3 && !strncasecmp(p, "Age", 3))
+        {
+            long age = delta_seconds(v, vend);
+            c->age = age > 0 ? age : 0;
+        }
+        p = next;
+    }
+
+    /* Generated at date, or when received if the server does not say */
+    long base = date >= 0 ? date : now;
+    if (now - base > c->age)
+        c->age = now - base;
+
+    c->explicit = 1;
+    if (s_maxage >= 0)
+        c->lifetime = s_maxage;
+    else if (max_age >= 0)
+        c->lifetime = max_age;
+    else if (has_expires)
+        c->lifetime = expires > base ? expires - base : 0;
+    else
+    {
+        c->explicit = 0;
+        if (modified >= 0 && modified < base)
+            c->lifetime = (base - modified) / 10;
+        else
+            c->lifetime = fallback;
+        if (c->lifetime > RESP_HEURISTIC_MAX)
+            c->lifetime = RESP_HEURISTIC_MAX;
+    }
+    if (no_cache || (pragma && !has_cc))
+    {
+        c->explicit = 1;
+        c->lifetime = 0;
+    }
+
+    for (int i = 0; i < sizeof(cacheable_status) / sizeof(int); ++i)
+    {
+        if (status == cacheable_status[i])
+            c->storable = !no_store &&
+                          (c->lifetime > c->age || c->validators);
+    }
+}
+
+/*
+ * Write the headers asking the end server whether the stored head of n
+ * bytes is still current to out: If-None-Match with its ETag and
+ * If-Modified-Since with its Last-Modified date.  Return their size, 0 if
+ * the head has neither or they need more than size bytes.
+ */
+size_t resp_conditional(const char *head, size_t n, char *out, size_t size)
+{
+    http_str etag = head_header(head, n, "ETag");
+    http_str modified = head_header(head, n, "Last-Modified");
+    size_t len = 0;
+
+    if (etag.len + modified.len + 48 > size)
+        return 0;
+    if (etag.len)
+        len += sprintf(out + len, "If-None-Match: %.*s\r\n",
+                       (int)etag.len, etag.p);
+    if (modified.len)
+        len += sprintf(out + len, "If-Modified-Since: %.*s\r\n",
+                       (int)modified.len, modified.p);
+    return len;
+}
+
+/* Handle the complete line in r->line */
+static void resp_line(http_resp *r)
+{
+    char *line = r->line;
+    int empty = !strcmp(line, "\r\n") || !strcmp(line, "\n");
+
+    switch (r->state)
+    {
+    case RESP_HEADERS:
+        if (!r->status)             /* status line */
+        {
+            int major, minor;
+            if (sscanf(line, "HTTP/%d.%d %d", &major, &minor,
+                       &r->status) != 3 || r->status <= 0)
+            {
+                r->state = RESP_ERROR;
+                return;
+            }
+            r->keepalive = major > 1 || (major == 1 && minor >= 1);
+        }
+        else if (empty)             /* end of headers */
+        {
+            if (r->status / 100 == 1)           /* interim, another follows */
+            {
+                r->status = 0;
+                r->content_length = -1;
+                r->chunked = 0;
+            }
+            else if (r->status == 204 || r->status == 304)
+                r->state = RESP_DONE;
+            else if (r->chunked)
+                r->state = RESP_CHUNK_SIZE;
+            else if (r->content_length >= 0)
+            {
+                r->remaining = r->content_length;
+                r->state = r->remaining ? RESP_BODY_LENGTH : RESP_DONE;
+            }
+            else
+            {
+                r->keepalive = 0;
+                r->state = RESP_BODY_EOF;
+            }
+        }
+        else
+        {
+            char *colon = strchr(line, ':');
+            if (!colon)
+            {
+                r->state = RESP_ERROR;
+                return;
+            }
+            *colon = '\0';
+            resp_header(r, line, colon + 1);
+        }
+        break;
+
+    case RESP_CHUNK_SIZE:
+    {
+        char *end;
+        r->remaining = strtol(line, &end, 16);
+        if (end == line || r->remaining < 0)
+            r->state = RESP_ERROR;
+        else
+            r->state = r->remaining ? RESP_CHUNK_DATA : RESP_TRAILER;
+        break;
+    }
+
+    case RESP_CHUNK_CRLF:
+        r->state = empty ? RESP_CHUNK_SIZE : RESP_ERROR;
+        break;
+
+    case RESP_TRAILER:
+        if (empty)
+            r->state = RESP_DONE;
+        break;
+    }
+}
+
+/* Request line: method, uri and version separated by blanks */
+static int req_line(http_req *r, const char *p, size_t len)
+{
+    const char *end = p + len;
+    http_str *tokens[3] = {&r->method, &r->uri, &r->version};
+
+    for (int i = 0; i < 3; ++i)
+    {
+        while (p < end && IS_BLANK(*p))
+            p++;
+        tokens[i]->p = p;
+        while (p < end && !IS_BLANK(*p))
+            p++;
+        tokens[i]->len = p - tokens[i]->p;
+        if (!tokens[i]->len)
+            return -1;
+    }
+    while (p < end && IS_BLANK(*p))
+        p++;
+    if (p != end)
+        return -1;
+
+    r->keepalive = r->version.len == 8 &&
+                   !strncasecmp(r->version.p, "HTTP/1.1", 8);
+    return req_uri(r);
+}
+
+/*
+ * Split the uri into host, port and path: it is host:port for CONNECT,
+ * otherwise scheme://host[:port][/path]
+ */
+static int req_uri(http_req *r)
+{
+    const char *p = r->uri.p, *end = p + r->uri.len, *colon = NULL;
+    int connect = str_is(r->method, "CONNECT");
+
+    if (!connect)
+    {
+        while (p + 1 < end && (p[0] != '/' || p[1] != '/'))
+            p++;
+        if (p + 1 >= end)
+            return -1;
+        p += 2;
+    }
+
+    r->host.p = p;
+    for (; p < end && *p != '/'; ++p)
+    {
+        if (*p == ':' && !colon)
+            colon = p;
+    }
+    r->host.len = (colon ? colon : p) - r->host.p;
+    if (colon)
+    {
+        r->port.p = colon + 1;
+        r->port.len = p - r->port.p;
+    }
+    else
+    {
+        r->port.p = "80";
+        r->port.len = 2;
+    }
+    r->path.p = p < end ? p : "/";
+    r->path.len = p < end ? end - p : 1;
+
+    if (!r->host.len || !r->port.len)
+        return -1;
+    return connect && (!colon || p != end) ? -1 : 0;
+}
+
+/* Header line: name, colon, value */
+static int req_header_line(http_req *r, const char *p, size_t len)
+{
+    const char *colon = memchr(p, ':', len), *v, *end = p + len;
+
+    /* Folded lines are obsolete, and there is a limit on headers */
+    if (!colon || colon == p || IS_BLANK(*p) || r->nheaders == REQ_HEADERS)
+        return -1;
+
+    http_header *h = &r->headers[r->nheaders++];
+    h->line.p = p;
+    h->line.len = len;
+    h->name.p = p;
+    h->name.len = colon - p;
+    for (v = colon + 1; v < end && IS_BLANK(*v); ++v)
+        ;
+    while (end > v && IS_BLANK(end[-1]))
+        end--;
+    h->value.p = v;
+    h->value.len = end - v;
+
+    h->id = HDR_OTHER;
+    for (int i = 0; i < sizeof(known_headers) / sizeof(known_headers[0]);
+         ++i)
+    {
+        if (h->name.len == known_headers[i].len &&
+            !strncasecmp(p, known_headers[i].name, h->name.len))
+            h->id = known_headers[i].id;
+    }
+
+    /* Connection and Proxy-Connection may override the default */
+    if (h->id == HDR_CONNECTION || h->id == HDR_PROXY_CONNECTION)
+    {
+        if (has_token(h->value.p, h->value.len, "close"))
+            r->keepalive = 0;
+        else if (has_token(h->value.p, h->value.len, "keep-alive"))
+            r->keepalive = 1;
+    }
+    else if (h->id == HDR_ACCEPT_ENCODING)
+        r->gzip = accepts_coding(h->value.p, h->value.len, "gzip");
+    else if (h->id == HDR_RANGE)
+        r->range = range_spec(h->value.p, h->value.len, &r->range_first,
+                              &r->range_last);
+    else if (h->id == HDR_IF_RANGE)
+        r->if_range = str_copy(r->validator, REQ_VALIDATOR, h->value) < 0
+                          ? -1 : 1;
+    return 0;
+}
+
+/* Add len bytes at p to iov, extending the last piece if they follow it */
+static void piece(struct iovec *iov, int *n, const char *p, size_t len)
+{
+    if (*n && (char *)iov[*n - 1].iov_base + iov[*n - 1].iov_len == p)
+        iov[*n - 1].iov_len += len;
+    else
+    {
+        iov[*n].iov_base = (void *)p;
+        iov[*n].iov_len = len;
+        (*n)++;
+    }
+}
+
+/* Headers that decide framing and connection reuse */
+static void resp_header(http_resp *r, char *name, char *value)
+{
+    if (!strcasecmp(name, "Content-Length"))
+    {
+        char *end;
+        r->content_length = strtol(value, &end, 10);
+        if (end == value || r->content_length < 0)
+            r->state = RESP_ERROR;
+    }
+    else if (!strcasecmp(name, "Transfer-Encoding"))
+        r->chunked = has_token(value, strlen(value), "chunked");
+    else if (!strcasecmp(name, "Connection"))
+    {
+        if (has_token(value, strlen(value), "close"))
+            r->keepalive = 0;
+        else if (has_token(value, strlen(value), "keep-alive"))
+            r->keepalive = 1;
+    }
+}
+
+/* Whether the comma separated header value of n bytes contains token */
+int has_token(const char *value, size_t n, const char *token)
+{
+    const char *end = value + n;
+    size_t len = strlen(token);
+    while (value < end)
+    {
+        while (value < end && (IS_BLANK(*value) || *value == ','))
+            value++;
+        if (end - value >= len && !strncasecmp(value, token, len))
+        {
+            if (end - value == len || value[len] == ',' ||
+                isspace((unsigned char)value[len]) || value[len] == ';')
+                return 1;
+        }
+        while (value < end && *value != ',')
+            value++;
+    }
+    return 0;
+}
+
+/* Value of the header called name in a head of n bytes, empty if none */
+http_str head_header(const char *head, size_t n, const char *name)
+{
+    const char *p = head, *end = head + n;
+    size_t nlen = strlen(name);
+    http_str s = {NULL, 0};
+
+    while (p < end)
+    {
+        const char *nl = memchr(p, '\n', end - p);
+        const char *next = nl ? nl + 1 : end;
+        size_t len = (nl ? nl : end) - p;
+        if (len && p[len - 1] == '\r')
+            len--;
+        if (len > nlen && p[nlen] == ':' && !strncasecmp(p, name, nlen))
+        {
+            const char *v = p + nlen + 1, *vend = p + len;
+            while (v < vend && IS_BLANK(*v))
+                v++;
+            while (vend > v && IS_BLANK(vend[-1]))
+                vend--;
+            s.p = v;
+            s.len = vend - v;
+            return s;
+        }
+        p = next;
+    }
+    return s;
+}
+
+/* Whether every element of the comma separated value of n bytes is token */
+static int only_token(const char *value, size_t n, const char *token)
+{
+    const char *end = value + n;
+    size_t len = strlen(token);
+    while (value < end)
+    {
+        while (value < end && (IS_BLANK(*value) || *value == ','))
+            value++;
+        const char *e = value;
+        while (e < end && *e != ',' && !IS_BLANK(*e))
+            e++;
+        if (e > value && (e - value != len || strncasecmp(value, token, len)))
+            return 0;
+        value = e;
+    }
+    return 1;
+}
+
+/*
+ * Whether an Accept-Encoding value of n bytes takes coding, by name or
+ * as *, with a q-value other than 0
+ */
+static int accepts_coding(const char *value, size_t n, const char *coding)
+{
+    const char *end = value + n;
+    size_t len = strlen(coding);
+    while (value < end)
+    {
+        while (value < end && (IS_BLANK(*value) || *value == ','))
+            value++;
+        const char *e = value;
+        while (e < end && *e != ',' && *e != ';' && !IS_BLANK(*e))
+            e++;
+        int match = (e - value == len && !strncasecmp(value, coding, len)) ||
+                    (e - value == 1 && *value == '*');
+        const char *next = memchr(e, ',', end - e);
+        if (!next)
+            next = end;
+
+        /* ;q=0, 0.0 and so on refuse it */
+        const char *q = e;
+        while (q < next && (IS_BLANK(*q) || *q == ';'))
+            q++;
+        if (match && next - q >= 3 && !strncasecmp(q, "q=", 2))
+        {
+            for (q += 2; q < next && (*q == '0' || *q == '.'); ++q)
+                ;
+            match = q < next && isdigit((unsigned char)*q);
+        }
+        if (match)
+            return 1;
+        value = next;
+    }
+    return 0;
+}
+
+/* Seconds of the Cache-Control directive name=seconds, -1 if absent */
+static long cc_seconds(const char *value, size_t n, const char *name)
+{
+    const char *end = value + n;
+    size_t len = strlen(name);
+    while (value < end)
+    {
+        while (value < end && (IS_BLANK(*value) || *value == ','))
+            value++;
+        if (end - value > len && !strncasecmp(value, name, len) &&
+            value[len] == '=')
+        {
+            const char *d = value + len + 1;
+            if (d < end && *d == '"')
+                d++;
+            return delta_seconds(d, end);
+        }
+        while (value < end && *value != ',')
+            value++;
+    }
+    return -1;
+}
+
+/* Number of seconds starting at p, -1 if none; huge ones are cut short */
+static long delta_seconds(const char *p, const char *end)
+{
+    long secs = 0;
+    if (p == end || !isdigit((unsigned char)*p))
+        return -1;
+    for (; p < end && isdigit((unsigned char)*p); ++p)
+    {
+        if (secs < 0x7fffffff / 10)
+            secs = secs * 10 + (*p - '0');
+    }
+    return secs;
+}
+
+/*
+ * Parse the Range value of n bytes if it asks for a single byte range:
+ * set *first and *last as in http_req and return 1, otherwise 0
+ */
+static int range_spec(const char *p, size_t n, long *first, long *last)
+{
+    const char *end = p + n;
+
+    if (n < 6 || strncasecmp(p, "bytes=", 6) || memchr(p, ',', n))
+        return 0;
+    for (p += 6; p < end && IS_BLANK(*p); ++p)
+        ;
+    *first = delta_seconds(p, end);
+    while (p < end && isdigit((unsigned char)*p))
+        p++;
+    if (p == end || *p++ != '-')
+        return 0;
+    *last = delta_seconds(p, end);
+    while (p < end && isdigit((unsigned char)*p))
+        p++;
+    while (p < end && IS_BLANK(*p))
+        p++;
+    return p == end && (*first >= 0 || *last >= 0) &&
+           (*first < 0 || *last < 0 || *first <= *last);
+}
+
+/* Seconds since the epoch of an HTTP date, -1 if it is not one */
+static long http_date(const char *p, size_t n)
+{
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    char buf[64], mon[4];
+    const char *m;
+    struct tm tm;
+
+    if (n >= sizeof(buf))
+        return -1;
+    memcpy(buf, p, n);
+    buf[n] = '\0';
+    memset(&tm, 0, sizeof(tm));
+    if (sscanf(buf, "%*3s, %d %3s %d %d:%d:%d GMT", &tm.tm_mday, mon,
+               &tm.tm_year, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6 ||
+        strlen(mon) != 3 || !(m = strstr(months, mon)) || (m - months) % 3)
+        return -1;
+    tm.tm_mon = (m - months) / 3;
+    tm.tm_year -= 1900;
+    return timegm(&tm);
+}
+
+/* Connection, Proxy-Connection and Keep-Alive only concern one hop */
+static int is_hop_header(const char *line)
+{
+    return !strncasecmp(line, "Connection:", 11) ||
+           !strncasecmp(line, "Proxy-Connection:", 17) ||
+           !strncasecmp(line, "Keep-Alive:", 11);
+}
@@ -0,0 +1,167 @@
+/*
+ * http.h - incremental HTTP message parsing for the proxy
+ */
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+/* States of a response parser */
+enum
+{
+    RESP_HEADERS,       /* status line and headers */
+    RESP_BODY_LENGTH,   /* body delimited by Content-Length */
+    RESP_CHUNK_SIZE,    /* chunked body: size line */
+    RESP_CHUNK_DATA,    /* chunked body: chunk bytes */
+    RESP_CHUNK_CRLF,    /* chunked body: CRLF after the chunk */
+    RESP_TRAILER,       /* chunked body: trailer lines */
+    RESP_BODY_EOF,      /* body delimited by closing the connection */
+    RESP_DONE,          /* complete response */
+    RESP_ERROR          /* malformed response */
+};
+
+#define RESP_LINE 8192  /* longest status, header, chunk or trailer line */
+#define RESP_HEAD 32768 /* longest status line plus headers */
+
+/* Room resp_head_conn() needs beyond the head it rewrites */
+#define RESP_CONN_EXTRA 32
+
+/* Room resp_range_head() needs beyond the head it rewrites */
+#define RESP_RANGE_EXTRA 256
+
+/* Where a response ends, learned while it streams by */
+typedef struct
+{
+    int state;
+    int status;             /* status code */
+    int keepalive;          /* connection may carry another response */
+    long content_length;    /* -1 if absent */
+    int chunked;
+    long remaining;         /* body or chunk bytes still expected */
+    size_t header_len;      /* bytes of status line and headers */
+    int linelen;
+    char line[RESP_LINE];   /* partial line */
+} http_resp;
+
+/* Longest heuristic freshness, from the age of Last-Modified */
+#define RESP_HEURISTIC_MAX 86400
+
+/* Room resp_conditional() needs for the validators of a stored head */
+#define RESP_CONDITIONAL (2 * RESP_LINE)
+
+/* What a shared cache may do with a response, from its head */
+typedef struct
+{
+    int storable;           /* the cache may keep it */
+    int explicit;           /* lifetime given by max-age or Expires */
+    long lifetime;          /* seconds fresh after it was generated */
+    long age;               /* seconds since then, when received */
+    int validators;         /* has an ETag or Last-Modified */
+} http_cache;
+
+/* Results of req_parse() */
+#define REQ_ERROR -1    /* malformed request */
+#define REQ_MORE 0      /* incomplete head, call again with more bytes */
+#define REQ_DONE 1      /* complete head */
+
+#define REQ_HEADERS 64  /* most headers a request may carry */
+#define REQ_HOST 256    /* room for a host name and its NUL */
+#define REQ_PORT 16     /* room for a port and its NUL */
+#define REQ_VALIDATOR 128   /* room for an If-Range value and its NUL */
+
+/* Results of req_range() */
+#define RANGE_NONE 0        /* send the whole object */
+#define RANGE_PART 1        /* send the bytes first to last of the body */
+#define RANGE_UNSATISFIABLE -1  /* answer 416 */
+
+/* Most pieces req_iov() cuts a request into, for own headers */
+#define REQ_IOV(nown) (6 + (nown) + 2 * REQ_HEADERS)
+
+/* Request headers the proxy replaces instead of forwarding them */
+enum
+{
+    HDR_OTHER,
+    HDR_HOST,
+    HDR_USER_AGENT,
+    HDR_CONNECTION,
+    HDR_PROXY_CONNECTION,
+    HDR_KEEP_ALIVE,
+    HDR_IF_NONE_MATCH,
+    HDR_IF_MODIFIED_SINCE,
+    HDR_ACCEPT_ENCODING,
+    HDR_RANGE,
+    HDR_IF_RANGE
+};
+
+/* Bytes of a buffer, not NUL terminated */
+typedef struct
+{
+    const char *p;
+    size_t len;
+} http_str;
+
+typedef struct
+{
+    int id;                 /* HDR_* */
+    http_str name;
+    http_str value;         /* without surrounding blanks */
+    http_str line;          /* the whole line, without its line break */
+} http_header;
+
+/*
+ * A request head, parsed where it lies: every http_str points into the
+ * buffer given to req_parse()
+ */
+typedef struct
+{
+    const char *buf;        /* buffer being parsed */
+    size_t scanned;         /* bytes of it parsed so far */
+    size_t len;             /* size of the complete head */
+    http_str method, uri, version;
+    http_str host, port, path;  /* parts of uri */
+    int keepalive;          /* client connection may carry another request */
+    int gzip;               /* client takes the gzip content coding */
+    int range;              /* client asked for one byte range: */
+    long range_first;       /* from here, -1 for the last range_last bytes */
+    long range_last;        /* to here, -1 for the end */
+    int if_range;           /* 1 if validator is set, -1 if too long */
+    char validator[REQ_VALIDATOR];  /* If-Range: the range only if current */
+    int nheaders;
+    http_header headers[REQ_HEADERS];
+} http_req;
+
+void resp_init(http_resp *r);
+size_t resp_parse(http_resp *r, const char *buf, size_t n);
+void resp_eof(http_resp *r);
+
+void req_init(http_req *r);
+int req_parse(http_req *r, const char *buf, size_t n);
+const http_str *req_header(const http_req *r, const char *name);
+int req_iov(const http_req *r, struct iovec *iov, const char *const *own);
+size_t req_rewrite(const http_req *r, char *out, size_t size,
+                   const char *const *own);
+int req_range(const http_req *r, const char *head, size_t hsize,
+              size_t body, size_t *first, size_t *last);
+int str_is(http_str s, const char *cstr);
+int str_copy(char *out, size_t size, http_str s);
+
+/* Hop-by-hop handling of the client connection */
+size_t resp_strip_head(char *head, size_t n);
+size_t resp_head_size(const char *obj, size_t n);
+size_t resp_head_conn(char *out, const char *head, size_t hsize, int keep);
+const char *resp_conn_line(int keep);
+size_t resp_range_head(char *out, const char *head, size_t hsize, int range,
+                       size_t first, size_t last, size_t body, int keep);
+
+/* Headers of a stored head */
+int resp_status(const char *head, size_t n);
+http_str head_header(const char *head, size_t n, const char *name);
+int has_token(const char *value, size_t n, const char *token);
+
+/* Freshness and revalidation */
+void resp_cache(const char *head, size_t n, long now, long fallback,
+                http_cache *c);
+size_t resp_conditional(const char *head, size_t n, char *out, size_t size);
+
+#endif /* __HTTP_H__ */
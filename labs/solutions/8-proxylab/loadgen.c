@@ -0,0 +1,601 @@
+/*
+ * loadgen.c - load generator for the proxy and tiny
+ *
+ * Every thread keeps one client connection busy with GET requests for the
+ * files under a directory of the server's root (tiny/test_files unless
+ * told otherwise), through the proxy or straight to the server.  Files
+ * are ranked in an order fixed by the seed and picked with a Zipf
+ * popularity over the ranks, exponent 0 being uniform.  Two modes:
+ *   closed  a thread sends its next request as soon as the response to
+ *           the previous one is in; latency counts from the send
+ *   open    requests are due at a constant total rate, spread over the
+ *           threads; latency counts from when a request was due, so a
+ *           stall also counts for the requests it kept from being sent
+ * With -k a connection carries requests until the server closes it.  With
+ * -T it is a CONNECT tunnel to the server, opened again whenever the
+ * server closes it.  Latencies go into a log-linear histogram per thread
+ * with 1/1024 relative precision, as HdrHistogram keeps them, merged at
+ * the end.
+ *
+ * usage: loadgen [options] server-host:port [proxy-host:port]
+ */
+#include "csapp.h"
+#include "http.h"
+#include <dirent.h>
+#include <math.h>
+
+#define DEFAULT_THREADS 8
+#define DEFAULT_SECONDS 10
+#define DEFAULT_WARMUP 1
+#define DEFAULT_RATE 1000
+#define DEFAULT_ZIPF 1.0
+#define DEFAULT_ROOT "tiny"
+#define DEFAULT_DIR "test_files"
+
+#define MAX_FILES 4096
+#define MAX_PATH 1024
+
+/* Histogram: values below HIST_SUB microseconds are exact, then each
+ * power of two is split in HIST_HALF slots */
+#define HIST_SUB 2048
+#define HIST_HALF 1024
+#define HIST_RANGES 30
+#define HIST_SLOTS (HIST_SUB + HIST_RANGES * HIST_HALF)
+
+#define MODE_CLOSED 0
+#define MODE_OPEN 1
+
+typedef struct
+{
+    long count[HIST_SLOTS];
+    long total, max, sum;       /* microseconds */
+} hist_t;
+
+typedef struct
+{
+    pthread_t tid;
+    int id;
+    unsigned long rng;
+    int fd;                     /* connection, -1 if none */
+    long requests;              /* recorded, after the warmup */
+    long errors;                /* transport or framing errors */
+    long non2xx;
+    long bytes;
+    long connects;
+    hist_t *hist;
+} worker_t;
+
+/* Settings, from the command line */
+static int nthreads = DEFAULT_THREADS;
+static int seconds = DEFAULT_SECONDS, warmup = DEFAULT_WARMUP;
+static int mode = MODE_CLOSED;
+static double rate = DEFAULT_RATE;
+static double zipf = DEFAULT_ZIPF;
+static int keepalive, tunnel, gzip_ok, quiet;
+static unsigned long seed = 1;
+static char *root = DEFAULT_ROOT, *dir = DEFAULT_DIR;
+static char server_host[MAXLINE], server_port[MAXLINE];
+static char proxy_host[MAXLINE], proxy_port[MAXLINE];
+static int proxied;
+
+/* Files requested, by rank, and the cumulative popularity of the ranks */
+static char *paths[MAX_FILES];
+static int nfiles;
+static double *cdf;
+
+static long begin_ns, start_ns, end_ns;    /* threads go, record, stop */
+
+static void usage(char *prog);
+static int split_hostport(char *s, char *host, char *port);
+static void add_files(const char *path);
+static int by_name(const void *a, const void *b);
+static void rank_files(void);
+static int pick(worker_t *w);
+static unsigned long next_random(worker_t *w);
+static long now_ns(void);
+static void sleep_until(long ns);
+static void *run(void *vargp);
+static int fetch(worker_t *w, const char *path, long *bytes, int *status);
+static int open_conn(worker_t *w);
+static void close_conn(worker_t *w);
+static int exchange(worker_t *w, const char *req, size_t len, long *bytes,
+                    int *status);
+static void hist_add(hist_t *h, long us);
+static void hist_merge(hist_t *into, const hist_t *h);
+static long hist_percentile(const hist_t *h, double p);
+static void report(const worker_t *w);
+
+int main(int argc, char *argv[])
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:d:w:m:r:z:R:D:s:kTgq")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            if ((nthreads = atoi(optarg)) <= 0)
+                usage(argv[0]);
+            break;
+        case 'd':
+            if ((seconds = atoi(optarg)) <= 0)
+                usage(argv[0]);
+            break;
+        case 'w':
+            if ((warmup = atoi(optarg)) < 0)
+                usage(argv[0]);
+            break;
+        case 'm':
+            if (!strcmp(optarg, "closed"))
+                mode = MODE_CLOSED;
+            else if (!strcmp(optarg, "open"))
+                mode = MODE_OPEN;
+            else
+                usage(argv[0]);
+            break;
+        case 'r':
+            if ((rate = atof(optarg)) <= 0)
+                usage(argv[0]);
+            break;
+        case 'z':
+            if ((zipf = atof(optarg)) < 0)
+                usage(argv[0]);
+            break;
+        case 'R':
+            root = optarg;
+            break;
+        case 'D':
+            dir = optarg;
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 10);
+            break;
+        case 'k':
+            keepalive = 1;
+            break;
+        case 'T':
+            tunnel = 1;
+            break;
+        case 'g':
+            gzip_ok = 1;
+            break;
+        case 'q':
+            quiet = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind >= argc || argc - optind > 2 ||
+        split_hostport(argv[optind], server_host, server_port) < 0)
+        usage(argv[0]);
+    if ((proxied = argc - optind == 2) &&
+        split_hostport(argv[optind + 1], proxy_host, proxy_port) < 0)
+        usage(argv[0]);
+    if (tunnel && !proxied)
+        usage(argv[0]);
+
+    /* The files, as paths from the server's root */
+    char top[MAX_PATH];
+    snprintf(top, sizeof(top), "%s/%s", root, dir);
+    add_files(top);
+    if (!nfiles)
+    {
+        fprintf(stderr, "no files under %s\n", top);
+        exit(1);
+    }
+    rank_files();
+
+    Signal(SIGPIPE, SIG_IGN);
+    worker_t *workers = Calloc(nthreads, sizeof(worker_t));
+    begin_ns = now_ns();
+    start_ns = begin_ns + warmup * 1000000000L;
+    end_ns = start_ns + seconds * 1000000000L;
+    for (int i = 0; i < nthreads; ++i)
+    {
+        workers[i].id = i;
+        workers[i].rng = seed * 0x9E3779B97F4A7C15UL + i + 1;
+        workers[i].fd = -1;
+        workers[i].hist = Calloc(1, sizeof(hist_t));
+        Pthread_create(&workers[i].tid, NULL, run, &workers[i]);
+    }
+    for (int i = 0; i < nthreads; ++i)
+        Pthread_join(workers[i].tid, NULL);
+
+    /* Everything into the first worker */
+    for (int i = 1; i < nthreads; ++i)
+    {
+        workers[0].requests += workers[i].requests;
+        workers[0].errors += workers[i].errors;
+        workers[0].non2xx += workers[i].non2xx;
+        workers[0].bytes += workers[i].bytes;
+        workers[0].connects += workers[i].connects;
+        hist_merge(workers[0].hist, workers[i].hist);
+    }
+    report(&workers[0]);
+    return 0;
+}
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-t threads] [-d seconds] [-w warmup seconds] "
+                    "[-m closed|open] [-r requests/s] [-z zipf exponent] "
+                    "[-R server root] [-D directory] [-s seed] "
+                    "[-k keep-alive] [-T tunnel] [-g gzip] [-q one line] "
+                    "server-host:port [proxy-host:port]\n", prog);
+    exit(1);
+}
+
+static int split_hostport(char *s, char *host, char *port)
+{
+    char *colon = strrchr(s, ':');
+    if (!colon || colon == s || !colon[1])
+        return -1;
+    snprintf(host, MAXLINE, "%.*s", (int)(colon - s), s);
+    snprintf(port, MAXLINE, "%s", colon + 1);
+    return 0;
+}
+
+/* The regular files under path that a url can name as they are */
+static void add_files(const char *path)
+{
+    DIR *d = opendir(path);
+    struct dirent *e;
+    struct stat sb;
+    char sub[MAX_PATH];
+
+    if (!d)
+        return;
+    while ((e = readdir(d)) && nfiles < MAX_FILES)
+    {
+        if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..") ||
+            strpbrk(e->d_name, " %?#\"<>\\^`{|}") ||
+            snprintf(sub, sizeof(sub), "%s/%s", path, e->d_name) >=
+                sizeof(sub) ||
+            lstat(sub, &sb) < 0)
+            continue;
+        if (S_ISDIR(sb.st_mode))
+            add_files(sub);
+        else if (S_ISREG(sb.st_mode))
+            paths[nfiles++] = strdup(sub + strlen(root));
+    }
+    closedir(d);
+}
+
+static int by_name(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/*
+ * Sort the files, shuffle them with the seed, then give rank i the
+ * weight 1/(i+1)^zipf: the same seed ranks them the same everywhere
+ */
+static void rank_files(void)
+{
+    worker_t w = {.rng = seed};
+    double sum = 0;
+
+    qsort(paths, nfiles, sizeof(char *), by_name);
+    for (int i = nfiles - 1; i > 0; --i)
+    {
+        int j = next_random(&w) % (i + 1);
+        char *p = paths[i];
+        paths[i] = paths[j];
+        paths[j] = p;
+    }
+    cdf = Malloc(nfiles * sizeof(double));
+    for (int i = 0; i < nfiles; ++i)
+        cdf[i] = sum += pow(i + 1, -zipf);
+    for (int i = 0; i < nfiles; ++i)
+        cdf[i] /= sum;
+}
+
+/* Rank of the next file to request */
+static int pick(worker_t *w)
+{
+    double r = (next_random(w) >> 11) * (1.0 / (1UL << 53));
+    int lo = 0, hi = nfiles - 1;
+
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (cdf[mid] < r)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* xorshift64* */
+static unsigned long next_random(worker_t *w)
+{
+    w->rng ^= w->rng >> 12;
+    w->rng ^= w->rng << 25;
+    w->rng ^= w->rng >> 27;
+    return w->rng * 0x2545F4914F6CDD1DUL;
+}
+
+static long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void sleep_until(long ns)
+{
+    struct timespec ts = {ns / 1000000000L, ns % 1000000000L};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+           EINTR)
+        ;
+}
+
+/* Worker thread routine: requests until the end of the run */
+static void *run(void *vargp)
+{
+    worker_t *w = vargp;
+    double interval = 1e9 * nthreads / rate;     /* open loop, per thread */
+    double offset = (double)w->id / nthreads;   /* threads take turns */
+    long seq = 0, due = begin_ns + (long)(interval * offset);
+
+    while (1)
+    {
+        long sent;
+        if (mode == MODE_OPEN)
+        {
+            if (due >= end_ns)
+                break;
+            if (due > now_ns())
+                sleep_until(due);
+            sent = due;
+            due = begin_ns + (long)(interval * (++seq + offset));
+        }
+        else if ((sent = now_ns()) >= end_ns)
+            break;
+
+        long bytes = 0;
+        int status = 0;
+        int rc = fetch(w, paths[pick(w)], &bytes, &status);
+        long done = now_ns();
+        if (sent < start_ns)
+            continue;
+        if (rc < 0)
+        {
+            ++w->errors;
+            continue;
+        }
+        hist_add(w->hist, (done - sent) / 1000);
+        w->bytes += bytes;
+        if (status < 200 || status > 299)
+            ++w->non2xx;
+    }
+    w->requests = w->hist->total;
+    close_conn(w);
+    return NULL;
+}
+
+/*
+ * One request for path and its response, on a new connection if needed;
+ * the bytes and the status of the response in *bytes and *status
+ */
+static int fetch(worker_t *w, const char *path, long *bytes, int *status)
+{
+    char req[MAXLINE];
+    const char *conn = keepalive ? "keep-alive" : "close";
+    int len;
+
+    if (proxied && !tunnel)
+        len = snprintf(req, sizeof(req),
+                       "GET http://%s:%s%s HTTP/1.1\r\nHost: %s:%s\r\n"
+                       "Connection: %s\r\nProxy-Connection: %s\r\n%s\r\n",
+                       server_host, server_port, path, server_host,
+                       server_port, conn, conn,
+                       gzip_ok ? "Accept-Encoding: gzip\r\n" : "");
+    else
+        len = snprintf(req, sizeof(req),
+                       "GET %s HTTP/1.1\r\nHost: %s:%s\r\n"
+                       "Connection: %s\r\n%s\r\n",
+                       path, server_host, server_port, conn,
+                       gzip_ok ? "Accept-Encoding: gzip\r\n" : "");
+
+    /* A kept connection the server closed meanwhile gets a second try */
+    for (int attempt = 0; attempt < 2; ++attempt)
+    {
+        int reused = w->fd >= 0;
+        if (!reused && open_conn(w) < 0)
+            return -1;
+        int rc = exchange(w, req, len, bytes, status);
+        if (rc < 0 && reused && !*bytes)
+            continue;
+        return rc;
+    }
+    return -1;
+}
+
+/* Connect to the proxy or the server, through a tunnel with -T */
+static int open_conn(worker_t *w)
+{
+    char buf[MAXLINE];
+    size_t got = 0;
+
+    w->fd = proxied ? open_clientfd(proxy_host, proxy_port)
+                    : open_clientfd(server_host, server_port);
+    if (w->fd < 0)
+    {
+        w->fd = -1;
+        return -1;
+    }
+    ++w->connects;
+    if (!tunnel)
+        return 0;
+
+    int len = snprintf(buf, sizeof(buf),
+                       "CONNECT %s:%s HTTP/1.1\r\nHost: %s:%s\r\n\r\n",
+                       server_host, server_port, server_host, server_port);
+    if (rio_writen(w->fd, buf, len) < 0)
+    {
+        close_conn(w);
+        return -1;
+    }
+
+    /* The reply is a head alone, nothing follows until we speak */
+    while (got < sizeof(buf) - 1)
+    {
+        ssize_t n = read(w->fd, buf + got, sizeof(buf) - 1 - got);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        got += n;
+        buf[got] = '\0';
+        if (strstr(buf, "\r\n\r\n"))
+            break;
+    }
+    buf[got] = '\0';
+    if (!strstr(buf, "\r\n\r\n") || strncmp(buf, "HTTP/1.", 7) ||
+        atoi(buf + 9) != 200)
+    {
+        close_conn(w);
+        return -1;
+    }
+    return 0;
+}
+
+static void close_conn(worker_t *w)
+{
+    if (w->fd >= 0)
+        close(w->fd);
+    w->fd = -1;
+}
+
+/*
+ * Send req and read its response to the end, counting its bytes and its
+ * status; the connection is closed unless it may carry another request
+ */
+static int exchange(worker_t *w, const char *req, size_t len, long *bytes,
+                    int *status)
+{
+    static __thread http_resp resp;
+    char buf[65536];
+
+    if (rio_writen(w->fd, (void *)req, len) < 0)
+    {
+        close_conn(w);
+        return -1;
+    }
+    resp_init(&resp);
+    while (resp.state != RESP_DONE && resp.state != RESP_ERROR)
+    {
+        ssize_t n = read(w->fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            resp_eof(&resp);
+            break;
+        }
+        *bytes += n;
+        if (resp_parse(&resp, buf, n) < n)
+            resp.keepalive = 0;
+    }
+    *status = resp.status;
+    if (resp.state != RESP_DONE || !resp.keepalive || !keepalive)
+        close_conn(w);
+    return resp.state == RESP_DONE ? 0 : -1;
+}
+
+/* Slot of a latency of us microseconds */
+static int hist_slot(long us)
+{
+    if (us < HIST_SUB)
+        return us < 0 ? 0 : us;
+    int shift = 63 - __builtin_clzl(us) - 10;
+    int slot = HIST_SUB + (shift - 1) * HIST_HALF + (us >> shift) - HIST_HALF;
+    return slot < HIST_SLOTS ? slot : HIST_SLOTS - 1;
+}
+
+/* Highest latency of a slot */
+static long hist_value(int slot)
+{
+    if (slot < HIST_SUB)
+        return slot;
+    int shift = (slot - HIST_SUB) / HIST_HALF + 1;
+    long sub = (slot - HIST_SUB) % HIST_HALF + HIST_HALF;
+    return ((sub + 1) << shift) - 1;
+}
+
+static void hist_add(hist_t *h, long us)
+{
+    ++h->count[hist_slot(us)];
+    ++h->total;
+    h->sum += us;
+    if (us > h->max)
+        h->max = us;
+}
+
+static void hist_merge(hist_t *into, const hist_t *h)
+{
+    for (int i = 0; i < HIST_SLOTS; ++i)
+        into->count[i] += h->count[i];
+    into->total += h->total;
+    into->sum += h->sum;
+    if (h->max > into->max)
+        into->max = h->max;
+}
+
+/* Latency in microseconds that a fraction p of the requests did not pass */
+static long hist_percentile(const hist_t *h, double p)
+{
+    long want = (long)ceil(p * h->total), seen = 0;
+
+    if (!h->total)
+        return 0;
+    for (int i = 0; i < HIST_SLOTS; ++i)
+    {
+        seen += h->count[i];
+        if (seen >= want && seen)
+        {
+            long v = hist_value(i);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+/* What the run did, for people or, with -q, as one line for scripts */
+static void report(const worker_t *w)
+{
+    const hist_t *h = w->hist;
+    double rps = w->requests / (double)seconds;
+    double mbps = w->bytes / (double)seconds / (1 << 20);
+    static const double levels[] = {0.5, 0.75, 0.9, 0.99, 0.999, 0.9999};
+    static const char *const names[] = {"p50", "p75", "p90", "p99", "p99.9",
+                                        "p99.99"};
+
+    if (quiet)
+    {
+        printf("%.1f\t%.2f\t%ld\t%ld\t%ld\t%ld\t%ld\t%ld\n", rps, mbps,
+               hist_percentile(h, 0.5), hist_percentile(h, 0.9),
+               hist_percentile(h, 0.99), hist_percentile(h, 0.999), h->max,
+               w->errors + w->non2xx);
+        return;
+    }
+    printf("%s loop", mode == MODE_OPEN ? "open" : "closed");
+    if (mode == MODE_OPEN)
+        printf(" at %.0f requests/s", rate);
+    printf(", %d connections%s%s, %s %s:%s, zipf %.2f over %d files\n",
+           nthreads, keepalive ? " kept alive" : "",
+           tunnel ? " tunneled" : "", proxied ? "proxy" : "server",
+           proxied ? proxy_host : server_host,
+           proxied ? proxy_port : server_port, zipf, nfiles);
+    printf("%d s: %ld requests, %.1f requests/s, %.2f MB/s, %ld connects, "
+           "%ld errors, %ld not 2xx\n", seconds, w->requests, rps, mbps,
+           w->connects, w->errors, w->non2xx);
+    printf("latency (us): mean %.0f", h->total ? (double)h->sum / h->total
+                                               : 0.0);
+    for (int i = 0; i < 6; ++i)
+        printf(", %s %ld", names[i], hist_percentile(h, levels[i]));
+    printf(", max %ld\n", h->max);
+}
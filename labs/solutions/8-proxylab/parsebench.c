@@ -0,0 +1,172 @@
+/*
+ * parsebench.c - microbenchmark of request parsing
+ *
+ * Times the two ways the proxy has turned a client request into the
+ * request for the end server:
+ *   old   line by line copies out of the read buffer (as rio_readlineb
+ *         does), sscanf of the request line, phase_uri, and strstr to
+ *         pick the headers to forward
+ *   new   req_parse over the buffer in place, then req_rewrite
+ *
+ * usage: parsebench [iterations]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "http.h"
+
+#define MAXLINE 8192
+#define MAX_REQUEST (4 * MAXLINE)
+#define DEFAULT_ITERATIONS 1000000
+
+static const char *request =
+    "GET http://www.cs.cmu.edu:8080/~213/images/logo.png?v=3 HTTP/1.1\r\n"
+    "Host: www.cs.cmu.edu:8080\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 "
+    "Firefox/115.0\r\n"
+    "Accept: image/avif,image/webp,*/*\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Referer: http://www.cs.cmu.edu:8080/~213/index.html\r\n"
+    "Cookie: session=4f1c2e9a7b; theme=dark; tz=America%2FNew_York\r\n"
+    "Cache-Control: no-cache\r\n"
+    "Pragma: no-cache\r\n"
+    "X-Forwarded-Host: www.cs.cmu.edu\r\n"
+    "Proxy-Connection: keep-alive\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n";
+
+static char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; "
+                              "rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
+static char *connection_hdr = "Connection: keep-alive\r\n";
+static char *proxy_hdr = "Proxy-Connection: keep-alive\r\n";
+
+/* Copy the next line of *src into buf, like rio_readlineb */
+static size_t readline(const char **src, const char *end, char *buf,
+                       size_t maxlen)
+{
+    size_t n = 0;
+    while (*src < end && n < maxlen - 1)
+    {
+        char c = *(*src)++;
+        buf[n++] = c;
+        if (c == '\n')
+            break;
+    }
+    buf[n] = '\0';
+    return n;
+}
+
+/* phase_uri as the proxy had it */
+static int phase_uri(char *uri, char *hostname, char *query, char *port)
+{
+    char *hostpos = strstr(uri, "//");
+    if (!hostpos)
+        return -1;
+    hostpos += 2;
+    strcpy(hostname, hostpos);
+
+    char *querypos = strstr(hostname, "/");
+    if (querypos)
+    {
+        strcpy(query, querypos);
+        *querypos = '\0';
+    }
+    else
+        strcpy(query, "/");
+
+    char *portpos = strstr(hostname, ":");
+    if (portpos)
+    {
+        strcpy(port, portpos + 1);
+        *portpos = '\0';
+    }
+    else
+        strcpy(port, "80");
+    return 0;
+}
+
+/* The former doit and connect_server, up to the request to send */
+static size_t old_path(const char *in, size_t n, char *req)
+{
+    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+    char hostname[MAXLINE], query[MAXLINE], port[MAXLINE];
+    const char *src = in, *end = in + n;
+    int reqlen;
+
+    readline(&src, end, buf, MAXLINE);
+    if (sscanf(buf, "%s %s %s", method, uri, version) != 3 ||
+        strcmp(method, "GET") || phase_uri(uri, hostname, query, port) < 0)
+        return 0;
+
+    reqlen = snprintf(req, MAX_REQUEST, "GET %s HTTP/1.1\r\nHost: %s\r\n",
+                      query, hostname);
+    reqlen += snprintf(req + reqlen, MAX_REQUEST - reqlen, "%s%s%s",
+                       user_agent_hdr, connection_hdr, proxy_hdr);
+    while (readline(&src, end, buf, MAXLINE) > 0 && strcmp(buf, "\r\n"))
+    {
+        int len = strlen(buf);
+        if (!strstr(buf, "Host") && !strstr(buf, "User-Agent") &&
+            !strstr(buf, "Connection") && !strstr(buf, "Proxy-Connection") &&
+            reqlen + len + 2 < MAX_REQUEST)
+        {
+            memcpy(req + reqlen, buf, len);
+            reqlen += len;
+        }
+    }
+    memcpy(req + reqlen, "\r\n", 2);
+    return reqlen + 2;
+}
+
+/* The parser of http.c */
+static size_t new_path(const char *in, size_t n, char *req)
+{
+    const char *own[] = {user_agent_hdr, connection_hdr, proxy_hdr, NULL};
+    char hostname[REQ_HOST], port[REQ_PORT];
+    http_req r;
+
+    req_init(&r);
+    if (req_parse(&r, in, n) != REQ_DONE || !str_is(r.method, "GET") ||
+        str_copy(hostname, sizeof(hostname), r.host) < 0 ||
+        str_copy(port, sizeof(port), r.port) < 0)
+        return 0;
+    return req_rewrite(&r, req, MAX_REQUEST + MAXLINE, own);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double run(const char *name, size_t (*path)(const char *, size_t,
+                                                   char *), long iterations)
+{
+    static char req[MAX_REQUEST + MAXLINE];
+    size_t n = strlen(request), total = 0;
+    double start = now();
+
+    for (long i = 0; i < iterations; ++i)
+        total += path(request, n, req);
+    double ns = (now() - start) * 1e9 / iterations;
+    printf("%-4s %8.1f ns/request  (%zu bytes out)\n", name, ns,
+           total / iterations);
+    return ns;
+}
+
+int main(int argc, char *argv[])
+{
+    long iterations = argc > 1 ? atol(argv[1]) : DEFAULT_ITERATIONS;
+    if (iterations <= 0)
+    {
+        fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+        exit(1);
+    }
+
+    double old_ns = run("old", old_path, iterations);
+    double new_ns = run("new", new_path, iterations);
+    printf("speedup %.2fx\n", old_ns / new_ns);
+    return 0;
+}
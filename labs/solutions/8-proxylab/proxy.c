@@ -1,425 +1,953 @@
 #include <stdio.h>
 #include "csapp.h"
+#include "proxy.h"
+#include "cache.h"
+#include "http.h"
+#include "upstream.h"
+#include "flight.h"
+#include "dns.h"
+#include "disk.h"
+#include "snapshot.h"
+#include "sbuf.h"
+#include "encode.h"
+#include "stats.h"
+#include "trace.h"
 #include <string.h>
+#include <limits.h>
 
-/* If you want debugging output, use the following macro.  When you hand
- * in, remove the #define DEBUG line. */
-/* #define DEBUG */
-#ifdef DEBUG
-#define dbg_printf(...) printf(__VA_ARGS__)
-#else
-#define dbg_printf(...)
-#endif
+/* Default size of the worker pool and of the pending connection queue */
+#define DEFAULT_WORKERS 32
+#define DEFAULT_QUEUE 64
 
-/* Recommended max cache and object sizes */
-#define MAX_CACHE_SIZE 10490000
-#define MAX_OBJECT_SIZE 102400
-#define MAX_OBJECT_NUM 12
+/* Event loops relaying the tunnels of the threaded engine */
+#define TUNNEL_LOOPS 2
 
-int totalcachesize, totalcachenum, totaltime, totalread;
-sem_t cache_mutex, totaltime_mutex, read_mutex;
+/* Seconds a tunnel may stay idle unless told otherwise */
+#define DEFAULT_TUNNEL_TIMEOUT 300
 
-typedef struct
-{
-    char cache_obj[MAX_OBJECT_SIZE + 10];
-    char cache_url[MAXLINE + 10];
-    int empty;
-    int object_size;
-    int lutime;         /* time stamp */
-    sem_t time_mutex;   /* Protection for lutime */
-} cache_block;
-cache_block allcache[MAX_OBJECT_NUM];
+/* Which responses are cached, and for how long */
+#define CACHE_ALL 0         /* every complete one, until evicted */
+#define CACHE_HTTP 1        /* as their caching headers allow */
+
+/* Seconds a response without caching headers stays fresh */
+#define DEFAULT_FRESHNESS 300
+
+/* Default keep-alive limits of client connections */
+#define DEFAULT_CLIENT_TIMEOUT 15
+#define DEFAULT_CLIENT_REQUESTS 100
+
+/* Which engine serves the connections */
+#define ENGINE_THREAD 0     /* worker pool, blocking I/O */
+#define ENGINE_EPOLL 1      /* event loops, non-blocking I/O */
+
+/* What to do with a new connection when the pending queue is full */
+#define OVERLOAD_BLOCK 0    /* stop accepting until a slot frees up */
+#define OVERLOAD_REJECT 1   /* answer 503 and close immediately */
+
+sbuf_t connbuf;     /* accepted connections waiting for a worker */
+static char *snapshot;          /* file of the cache snapshot, if any */
+static sigset_t handled;        /* signals left to signal_thread */
+int client_timeout = DEFAULT_CLIENT_TIMEOUT;
+int client_requests = DEFAULT_CLIENT_REQUESTS;
+int tunnel_splice = 1;
+int tunnel_timeout = DEFAULT_TUNNEL_TIMEOUT;
+int freshness = DEFAULT_FRESHNESS;
+static int cache_rules = CACHE_ALL;
+int cache_gzip = 1;
 
 /* Some string constants */
 /* You won't lose style points for including this long line in your code */
-static char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
-static char *connection_hdr = "Connection: close\r\n";
-static char *proxy_hdr = "Proxy-Connection: close\r\n";
-static char *https_res = 
+char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
+char *connection_hdr = "Connection: keep-alive\r\n";
+char *proxy_hdr = "Proxy-Connection: keep-alive\r\n";
+char *encoding_hdr = "Accept-Encoding: identity\r\n";
+char *https_res = 
     "HTTP/1.1 200 Connection Established\r\nConnection: close\r\n\r\n";
+static char *overload_res = 
+    "HTTP/1.0 503 Service Unavailable\r\nConnection: close\r\n"
+    "Content-Length: 0\r\n\r\n";
 
 /* functions for running the thread-based proxy */
+void usage(char *prog);
 void *thread(void *vargp);
+void *signal_thread(void *vargp);
+void print_stats(FILE *fp);
+void reject(int fd);
 void doit(int fd);
 
 /* functions for maintain http requests */
-void connect_server(char *uri, char *hostname, char *query, 
-                    char *port, int connfd, rio_t *rio_client);
-
-/* functions for maintain https requests */
-int phase_uri(char *uri, char *hostname, char *query, char *port);
-void phase_uri_https(char *uri, char *hostname, char *port);
-void *https_send(void *vargp);
-
-/* functions for maintaining the cache of proxy */
-void cache_init();
-int cache_find(char *url);
-int cache_evict(int size);
-int cache_read(char *dest_buf, char *url);
-void cache_write(char *buf, char *url, int size);
+int connect_server(http_req *request, char *uri, char *hostname, char *port,
+                   int connfd, int keep);
+int writev_all(int fd, const struct iovec *iov, int n);
+size_t send_hit(int connfd, const char *obj, size_t size, int *keep);
+size_t send_object(int connfd, const char *obj, size_t size,
+                   const http_req *r, int *keep);
+size_t send_range(int connfd, const char *obj, size_t size,
+                  const http_req *r, int *keep);
+int follow_flight(int connfd, flight *f, int keep, long started);
+void record_request(int outcome, long started, long bytes, const char *uri);
+int relay_response(int serverfd, int connfd, http_resp *resp,
+                   char *cache_buf, int *keep, flight *f, char *uri,
+                   int revalidate, long *expires);
 
 int main(int argc, char *argv[])
 {
     Signal(SIGPIPE, SIG_IGN);
-    cache_init();
 
-    int listenfd, *connfd;
+    int listenfd, connfd, opt;
+    int nworkers, nqueue = DEFAULT_QUEUE, nshards = DEFAULT_SHARDS;
+    int nidle = DEFAULT_UPSTREAM_IDLE, dns_ttl = DEFAULT_DNS_TTL;
+    int overload = OVERLOAD_BLOCK, engine = ENGINE_THREAD;
+    char *policy = DEFAULT_POLICY, *admission = DEFAULT_ADMISSION;
+    char *disk_dir = NULL, *trace_file = NULL;
+    int trace_every = 1;
+    long disk_budget = DEFAULT_DISK_BUDGET;
     char hostname[MAXLINE], port[MAXLINE];
     socklen_t clientlen;
     struct sockaddr_storage clientaddr;
     pthread_t tid;
 
     /* Check command line args */
-    if (argc != 2)
+    nworkers = 0;
+    while ((opt = getopt(argc, argv,
+                         "e:w:q:o:s:p:a:c:z:f:k:t:n:r:i:d:D:B:S:T:x:")) != -1)
     {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
+        switch (opt)
+        {
+        case 'e':
+            if (!strcmp(optarg, "thread"))
+                engine = ENGINE_THREAD;
+            else if (!strcmp(optarg, "epoll"))
+                engine = ENGINE_EPOLL;
+            else
+                usage(argv[0]);
+            break;
+        case 'w':
+            if ((nworkers = atoi(optarg)) <= 0)
+                usage(argv[0]);
+            break;
+        case 'q':
+            nqueue = atoi(optarg);
+            break;
+        case 's':
+            if ((nshards = atoi(optarg)) <= 0)
+                usage(argv[0]);
+            break;
+        case 'p':
+            policy = optarg;
+            break;
+        case 'a':
+            admission = optarg;
+            break;
+        case 'c':
+            if (!strcmp(optarg, "all"))
+                cache_rules = CACHE_ALL;
+            else if (!strcmp(optarg, "http"))
+                cache_rules = CACHE_HTTP;
+            else
+                usage(argv[0]);
+            break;
+        case 'z':
+            if (!strcmp(optarg, "gzip"))
+                cache_gzip = 1;
+            else if (!strcmp(optarg, "identity"))
+                cache_gzip = 0;
+            else
+                usage(argv[0]);
+            break;
+        case 'f':
+            if ((freshness = atoi(optarg)) < 0)
+                usage(argv[0]);
+            break;
+        case 'k':
+            if ((nidle = atoi(optarg)) < 0)
+                usage(argv[0]);
+            break;
+        case 't':
+            if ((client_timeout = atoi(optarg)) <= 0)
+                usage(argv[0]);
+            break;
+        case 'n':
+            if ((client_requests = atoi(optarg)) <= 0)
+                usage(argv[0]);
+            break;
+        case 'r':
+            if (!strcmp(optarg, "splice"))
+                tunnel_splice = 1;
+            else if (!strcmp(optarg, "copy"))
+                tunnel_splice = 0;
+            else
+                usage(argv[0]);
+            break;
+        case 'i':
+            if ((tunnel_timeout = atoi(optarg)) <= 0)
+                usage(argv[0]);
+            break;
+        case 'd':
+            if ((dns_ttl = atoi(optarg)) < 0)
+                usage(argv[0]);
+            break;
+        case 'D':
+            disk_dir = optarg;
+            break;
+        case 'B':
+            if ((disk_budget = atol(optarg)) <= 0)
+                usage(argv[0]);
+            break;
+        case 'S':
+            snapshot = optarg;
+            break;
+        case 'T':
+            trace_file = optarg;
+            break;
+        case 'x':
+            if ((trace_every = atoi(optarg)) <= 0)
+                usage(argv[0]);
+            break;
+        case 'o':
+            if (!strcmp(optarg, "block"))
+                overload = OVERLOAD_BLOCK;
+            else if (!strcmp(optarg, "reject"))
+                overload = OVERLOAD_REJECT;
+            else
+                usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || nqueue <= 0)
+        usage(argv[0]);
+
+    /* Every thread created from now on leaves these to signal_thread */
+    sigemptyset(&handled);
+    sigaddset(&handled, SIGUSR1);
+    sigaddset(&handled, SIGUSR2);
+    sigaddset(&handled, SIGINT);
+    sigaddset(&handled, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &handled, NULL);
+    Pthread_create(&tid, NULL, signal_thread, NULL);
+
+    stats_init();
+    if (trace_file && trace_init(trace_file, trace_every) < 0)
         exit(1);
+    if (cache_init(nshards, policy, admission) < 0)
+        usage(argv[0]);
+    if (snapshot)
+        snapshot_load(snapshot);
+    if (disk_dir && disk_init(disk_dir, disk_budget) < 0)
+        exit(1);
+    upstream_init(nidle);
+    flight_init();
+    dns_init(dns_ttl);
+    listenfd = Open_listenfd(argv[optind]);
+    if (listenfd < 0)
+        exit(1);
+
+    /* One event loop per core unless told otherwise */
+    if (engine == ENGINE_EPOLL)
+    {
+        if (!nworkers)
+            nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+        event_run(listenfd, nworkers > 0 ? nworkers : 1);
     }
 
-    listenfd = Open_listenfd(argv[1]);
+    if (!nworkers)
+        nworkers = DEFAULT_WORKERS;
+    event_tunnels(TUNNEL_LOOPS);
+    sbuf_init(&connbuf, nqueue);
+    for (int i = 0; i < nworkers; ++i)
+        Pthread_create(&tid, NULL, thread, NULL);
     while (1)
     {
         clientlen = sizeof(clientaddr);
-        connfd = malloc(sizeof(int));
-        *connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
+        connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
+        if (connfd < 0)
+            continue;
         Getnameinfo((SA *)&clientaddr, clientlen, hostname, MAXLINE,
                     port, MAXLINE, 0);
         dbg_printf("Accepted connection from (%s, %s)\n", hostname, port);
-        Pthread_create(&tid, NULL, thread, connfd);
+        trace_accept(connfd);
+        if (overload == OVERLOAD_BLOCK)
+            sbuf_insert(&connbuf, connfd);
+        else if (sbuf_tryinsert(&connbuf, connfd) < 0)
+            reject(connfd);
     }
     return 0;
 }
 
-/* thread routine */
+void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-e thread|epoll] [-w workers] [-q queue] "
+                    "[-o block|reject] [-s shards] [-p lru|clock|slru|gdsf] "
+                    "[-a tinylfu|all] [-c all|http] [-z gzip|identity] "
+                    "[-f default freshness] "
+                    "[-k idle upstreams per host] [-t client timeout] "
+                    "[-n requests per client] [-r splice|copy] "
+                    "[-i tunnel timeout] [-d dns ttl] [-D disk cache dir] "
+                    "[-B disk budget MB] [-S snapshot file] "
+                    "[-T trace file] [-x trace one request in] <port>\n",
+            prog);
+    exit(1);
+}
+
+/* worker thread routine: serve connections from the pending queue */
 void *thread(void *vargp)
 {
     Pthread_detach(pthread_self());
-    int connfd = *((int *)vargp);
-    Free(vargp);
-    doit(connfd);
+    while (1)
+    {
+        int connfd = sbuf_remove(&connbuf);
+        doit(connfd);
+    }
     return NULL;
 }
 
-/* main routine to serve requests */
-void doit(int fd)
+/*
+ * SIGUSR1 saves the cache snapshot, SIGUSR2 prints the cache statistics,
+ * SIGINT and SIGTERM save the snapshot and exit
+ */
+void *signal_thread(void *vargp)
 {
-    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-    char hostname[MAXLINE], query[MAXLINE], port[MAXLINE];
-    rio_t rio;
-    pthread_t tid;
-
-    /* Read request line and headers */
-    Rio_readinitb(&rio, fd);
-    if (!Rio_readlineb(&rio, buf, MAXLINE))
-        return;
-    dbg_printf("%s", buf);
-    sscanf(buf, "%s %s %s", method, uri, version);
+    int sig;
 
-    if (!strcmp(method, "CONNECT"))         /* https request */
+    Pthread_detach(pthread_self());
+    while (1)
     {
-        phase_uri_https(uri, hostname, port);
-        Rio_readlineb(&rio, buf, MAXLINE);
-        while (strcmp(buf, "\r\n"))         /* Just ignore other headers */
-            Rio_readlineb(&rio, buf, MAXLINE);
-
-        int clientfd = Open_clientfd(hostname, port);
-        if (clientfd < 0)
+        if (sigwait(&handled, &sig))
+            continue;
+        if (sig == SIGUSR2)
         {
-            Close(fd);
-            return;
+            print_stats(stderr);
+            continue;
+        }
+        if (snapshot && snapshot_save(snapshot) < 0)
+            fprintf(stderr, "snapshot %s: %s\n", snapshot, strerror(errno));
+        if (sig != SIGUSR1)
+        {
+            trace_flush();
+            exit(0);
         }
-        else
-            Write(fd, https_res, strlen(https_res));
-
-        /* Create another thread to get data from client and send to server */
-        int sendserver[2] = {0};
-        sendserver[0] = fd;
-        sendserver[1] = clientfd;
-        Pthread_create(&tid, NULL, https_send, sendserver);
-
-        /* get data from server and send to client */
-        char buf[MAXLINE + 10] = {};
-        int len;
-        while ((len = Read(clientfd, buf, MAXLINE)) > 0)
-            Write(fd, buf, len);
-
-        /* Close the connections */
-        Close(fd);
-        Close(clientfd);
-        return;
     }
+    return NULL;
+}
+
+/* One line of cache statistics */
+void print_stats(FILE *fp)
+{
+    cache_totals t;
+    cache_stats(&t);
+    long lookups = t.hits + t.misses + t.stale;
+    long served = t.hit_bytes + t.miss_bytes;
+
+    /* A stale object the end server confirmed counts as a hit */
+    fprintf(fp, "cache: %ld hits, %ld misses, %ld stale, %ld revalidated "
+                "(%.1f%% hits), "
+                "%ld of %ld bytes from cache (%.1f%% byte hits), "
+                "%ld inserted, %ld admitted, %ld rejected, %ld evicted, "
+                "%ld objects in %ld bytes\n",
+            t.hits, t.misses, t.stale, t.revalidated,
+            lookups ? 100.0 * (t.hits + t.revalidated) / lookups : 0.0,
+            t.hit_bytes, served, served ? 100.0 * t.hit_bytes / served : 0.0,
+            t.inserted, t.admitted, t.rejected, t.evicted, t.objects,
+            t.bytes);
+}
+
+/* queue is full: tell the client to come back later */
+void reject(int fd)
+{
+    dbg_printf("queue full, rejecting connection\n");
+    rio_writen(fd, overload_res, strlen(overload_res));
+    Close(fd);
+}
 
-    if (strcmp(method, "GET"))          /* Not http request */
+/* main routine to serve the requests of a client connection */
+void doit(int fd)
+{
+    char *buf = Malloc(MAX_REQUEST);
+    size_t len = 0;     /* bytes read into buf */
+    char hostname[REQ_HOST], port[REQ_PORT];
+    struct timeval idle = {client_timeout, 0};
+    long begun = trace_accepted(fd);    /* when the next request began */
+    long picked = stats_now();
+
+    /* Reading the next request gives up after the idle timeout */
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+    stats_connection(1);
+
+    for (int served = 1; ; ++served)
     {
-        printf("Proxy does not implement this method");
-        return;
+        http_req req;
+        trace_record tr;
+        int rc;
+
+        /* Read request line and headers, pipelined requests wait in buf */
+        req_init(&req);
+        if (served > 1)
+            begun = len ? stats_now() : 0;
+        while ((rc = req_parse(&req, buf, len)) == REQ_MORE)
+        {
+            ssize_t n = len < MAX_REQUEST ?
+                        read(fd, buf + len, MAX_REQUEST - len) : 0;
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            if (!begun)
+                begun = stats_now();
+            len += n;
+        }
+        if (rc != REQ_DONE ||
+            str_copy(hostname, sizeof(hostname), req.host) < 0 ||
+            str_copy(port, sizeof(port), req.port) < 0)
+            break;
+        dbg_printf("%.*s %.*s\n", (int)req.method.len, req.method.p,
+                   (int)req.uri.len, req.uri.p);
+
+        if (str_is(req.method, "CONNECT"))      /* https request */
+        {
+            int clientfd = dns_clientfd(hostname, port);
+            if (clientfd < 0 ||
+                rio_writen(fd, https_res, strlen(https_res)) < 0)
+            {
+                if (clientfd >= 0)
+                    Close(clientfd);
+                break;
+            }
+
+            /* The tunnel loops relay it from now on, this thread is free */
+            event_tunnel(fd, clientfd, buf + req.len, len - req.len);
+            stats_connection(-1);
+            Free(buf);
+            return;
+        }
+
+        if (!str_is(req.method, "GET"))         /* Not http request */
+        {
+            printf("Proxy does not implement this method");
+            break;
+        }
+
+        /* The blank after the uri ends it in place, it is the cache key */
+        char *uri = buf + (req.uri.p - buf);
+        uri[req.uri.len] = '\0';
+
+        trace_begin(&tr, begun);
+        if (served == 1)
+            trace_mark_at(TRACE_WORKER, picked);
+        trace_mark(TRACE_PARSED);
+
+        /* Serve http request */
+        if (!connect_server(&req, uri, hostname, port, fd,
+                            served < client_requests))
+            break;
+        memmove(buf, buf + req.len, len - req.len);
+        len -= req.len;
     }
+    trace_use(NULL);
+    stats_connection(-1);
+    Free(buf);
+    Close(fd);
+}
 
-    /* Serve http request */
-    phase_uri(uri, hostname, query, port);
-    connect_server(uri, hostname, query, port, fd, &rio);
-    return;
+/*
+ * The request for the end server, with our own headers and the
+ * conditional ones in cond, if any: copied into out, or as
+ * REQ_IOV(OWN_HEADERS) pieces at most in iov.  The response is asked for
+ * in the identity coding, which every client can be served from.
+ */
+size_t build_request(const http_req *r, char *out, const char *cond)
+{
+    const char *own[OWN_HEADERS + 1] = {user_agent_hdr, connection_hdr,
+                                        proxy_hdr, encoding_hdr, cond, NULL};
+    return req_rewrite(r, out, MAX_UPSTREAM, own);
 }
 
-/* phase https uri to hostname:port */
-void phase_uri_https(char *uri, char *hostname, char *port)
+int build_request_iov(const http_req *r, struct iovec *iov, const char *cond)
 {
-    strcpy(hostname, uri);
-    char *portpos = strstr(hostname, ":");
-    strcpy(port, portpos + 1);
-    *portpos = '\0';
-    return;
+    const char *own[OWN_HEADERS + 1] = {user_agent_hdr, connection_hdr,
+                                        proxy_hdr, encoding_hdr, cond, NULL};
+    return req_iov(r, iov, own);
 }
 
-/* get data from vargp[0] and send to vargp[1] */
-void *https_send(void *vargp)
+/* Cache the response of size bytes for uri, compressed if worth it */
+void cache_fill(char *obj, char *uri, int size, long expires)
 {
-    Pthread_detach(pthread_self());
-    int readfd = ((int *)vargp)[0];
-    int writefd = ((int *)vargp)[1];
-    char buf[MAXLINE + 10] = {};
-    int len;
-    while ((len = Read(readfd, buf, MAXLINE)) > 0)
-        Write(writefd, buf, len);
-    return NULL;
+    size_t zsize;
+    char *z = cache_gzip ? encode_gzip(obj, size, &zsize) : NULL;
+
+    if (!z)
+    {
+        cache_write(obj, uri, size, expires);
+        return;
+    }
+    cache_write(z, uri, zsize, expires);
+    Free(z);
 }
 
-/* phase http uri to hostname:port(optional)/query */
-int phase_uri(char *uri, char *hostname, char *query, char *port)
+/*
+ * Until when a response with the stored head of n bytes, just received,
+ * is fresh; -1 if it must not be cached, like a partial one.  Unless
+ * told to follow the caching headers, the proxy keeps everything for
+ * good: the Tiny server of the lab forbids caching, and the driver checks
+ * that it is cached.
+ */
+long fresh_until(const char *head, size_t n)
 {
-    char *hostpos = strstr(uri, "//");
-    if (!hostpos)
+    long now = time(NULL);
+    http_cache c;
+
+    if (resp_status(head, n) == 206)    /* never the whole object */
         return -1;
-    hostpos += 2;
-    strcpy(hostname, hostpos);
+    if (cache_rules == CACHE_ALL)
+        return LONG_MAX;
+    resp_cache(head, n, now, freshness, &c);
+    return c.storable ? now + c.lifetime - c.age : -1;
+}
+
+/*
+ * Until when the stored object of size bytes is fresh, now that the end
+ * server answered 304 with the head of n bytes: as the 304 says, or else
+ * as long as the object was fresh when received
+ */
+long refresh_until(const char *head, size_t n, const char *obj, size_t size)
+{
+    long now = time(NULL);
+    http_cache c;
 
-    char *querypos = strstr(hostname, "/");
-    if (querypos)
+    resp_cache(head, n, now, freshness, &c);
+    if (!c.explicit)
     {
-        strcpy(query, querypos);
-        *querypos = '\0';
+        resp_cache(obj, resp_head_size(obj, size), now, freshness, &c);
+        c.age = 0;
     }
-    else
-        strcpy(query, "/");
+    return now + c.lifetime - c.age;
+}
+
+/*
+ * Write all n pieces of iov, with one writev() unless the socket takes
+ * fewer bytes; iov is left as is, so it may be sent again
+ */
+int writev_all(int fd, const struct iovec *iov, int n)
+{
+    ssize_t rc;
+
+    while ((rc = writev(fd, iov, n)) < 0 && errno == EINTR)
+        ;
+    if (rc < 0)
+        return -1;
 
-    char *portpos = strstr(hostname, ":");
-    if (portpos)
+    /* Short write: the rest one piece at a time */
+    for (int i = 0; i < n; ++i)
     {
-        strcpy(port, portpos + 1);
-        *portpos = '\0';
+        if (rc >= iov[i].iov_len)
+        {
+            rc -= iov[i].iov_len;
+            continue;
+        }
+        if (rio_writen(fd, (char *)iov[i].iov_base + rc,
+                       iov[i].iov_len - rc) < 0)
+            return -1;
+        rc = 0;
     }
-    else
-        strcpy(port, "80");
     return 0;
-};
+}
 
-/* serve http request */
-void connect_server(char *uri, char *hostname, char *query, 
-                    char *port, int connfd, rio_t *rio_client)
+/*
+ * serve http request; keep tells whether the client connection may serve
+ * another one, return whether it does
+ */
+int connect_server(http_req *request, char *uri, char *hostname, char *port,
+                   int connfd, int keep)
 {
-    char cache_buf[MAX_OBJECT_SIZE + 10] = {};
+    long started = stats_now();
+    dbg_printf("send HTTP request start\n");
+    keep = keep && request->keepalive;
 
-    /* Find the request in cache first */
-    int cachelen = cache_read(cache_buf, uri);
-    if (cachelen >= 0)
+    /* Our own statistics, never cached */
+    if (stats_is_request(request))
     {
-        dbg_printf("send back, len: %d\n", cachelen);
-        Rio_writen(connfd, cache_buf, cachelen);
-        Close(connfd);
-        return;
+        size_t size;
+        char *obj = stats_response(&size);
+        send_hit(connfd, obj, size, &keep);
+        Free(obj);
+        return keep;
     }
 
-    int clientfd = Open_clientfd(hostname, port);
-    if (clientfd < 0)
+    /* Find the request in cache first, send it without copying */
+    cache_block *hit = cache_read(uri);
+    disk_hit dhit = {NULL};
+    int on_disk = !hit && disk_read(uri, &dhit) == 0;
+    trace_mark(TRACE_LOOKUP);
+    if (hit && cache_fresh(hit))
     {
-        printf("connection failed\n");
-        Close(connfd);
-        return;
+        size_t sent = send_object(connfd, hit->cache_obj, hit->object_size,
+                                  request, &keep);
+        record_request(STATS_HIT, started, sent, uri);
+        cache_served(hit, sent);
+        cache_release(hit);
+        return keep;
+    }
+    if (on_disk && dhit.expires > time(NULL))
+    {
+        size_t sent = send_object(connfd, dhit.data, dhit.size, request,
+                                  &keep);
+        record_request(STATS_HIT, started, sent, uri);
+        cache_missed(sent);
+        disk_release(&dhit);
+        return keep;
     }
 
-    char buf[MAXLINE + 10] = {};
-
-    dbg_printf("send HTTP request start\n");
-    sprintf(buf, "GET %s HTTP/1.0\r\n", query);
-    Rio_writen(clientfd, buf, strlen(buf));
-    sprintf(buf, "Host: %s\r\n", hostname);
-    Rio_writen(clientfd, buf, strlen(buf));
-    Rio_writen(clientfd, user_agent_hdr, strlen(user_agent_hdr));
-    Rio_writen(clientfd, connection_hdr, strlen(connection_hdr));
-    Rio_writen(clientfd, proxy_hdr, strlen(proxy_hdr));
-
-    /* Send other request headers */
-    Rio_readlineb(rio_client, buf, MAXLINE);
-    while (strcmp(buf, "\r\n"))
+    /* A stale copy is revalidated, unless it has nothing to ask with */
+    const char *stale = hit ? hit->cache_obj : dhit.data;
+    size_t stale_size = hit ? hit->object_size : dhit.size;
+    char cond[RESP_CONDITIONAL];
+    if (!stale || !resp_conditional(stale, resp_head_size(stale, stale_size),
+                                    cond, sizeof(cond)))
     {
-        if (!strstr(buf, "Host") && !strstr(buf, "User-Agent") && 
-            !strstr(buf, "Connection") && !strstr(buf, "Proxy-Connection"))
-            Rio_writen(clientfd, buf, strlen(buf));
-        Rio_readlineb(rio_client, buf, MAXLINE);
+        if (hit)
+            cache_release(hit);
+        if (dhit.seg)
+            disk_release(&dhit);
+        hit = NULL;
+        stale = NULL;
     }
-    Rio_writen(clientfd, "\r\n", strlen("\r\n"));
-    dbg_printf("send HTTP request end\r\n");
 
-    dbg_printf("get HTTP response start\n");
-    rio_t rio_server;
-    Rio_readinitb(&rio_server, clientfd);
+    /*
+     * The request is pieces of the client's buffer and of our headers,
+     * a stale pooled connection makes us send it again
+     */
+    struct iovec req[REQ_IOV(OWN_HEADERS)];
+    int nreq = build_request_iov(request, req, stale ? cond : NULL);
+
+    /* Someone is fetching it already: relay that response as it arrives */
+    int leader = 0;
+    flight *f = stale ? NULL : flight_join(uri, &leader);
+    if (f && !leader)
+    {
+        int rc = follow_flight(connfd, f, keep, started);
+        flight_release(f);
+        f = NULL;
+        if (rc >= 0)
+            return rc;
+    }
 
-    /* get response from end server and send to the client */
-    int len = 0;
+    char *cache_buf = Malloc(MAX_OBJECT_SIZE);
+    http_resp resp;
     int totallen = 0;   /* size of response */
-    while ((len = Rio_readnb(&rio_server, buf, MAXLINE)) > 0)
+    long expires = -1;  /* of the response, -1 if not to be cached */
+
+    resp_init(&resp);
+
+    for (int attempt = 0; attempt < 2; ++attempt)
     {
-        Rio_writen(connfd, buf, len);
-        dbg_printf("%s", buf);
-        dbg_printf("reponse size:%d\n", len);
-        totallen += len;
-        if (totallen <= MAX_OBJECT_SIZE)
-            memcpy(cache_buf + (totallen - len), buf, len);
-    }
-    dbg_printf("get HTTP response end\n");
+        int reused = 1;
+        int clientfd = upstream_take(hostname, port);
+        if (clientfd < 0)
+        {
+            reused = 0;
+            clientfd = dns_clientfd(hostname, port);
+        }
+        if (clientfd < 0)
+        {
+            printf("connection failed\n");
+            break;
+        }
+        trace_mark(TRACE_CONNECT);
+
+        if (writev_all(clientfd, req, nreq) < 0)
+        {
+            Close(clientfd);
+            if (reused)
+                continue;
+            break;
+        }
+        trace_mark(TRACE_SENT);
+        dbg_printf("send HTTP request end\r\n");
+
+        /* The server may have closed the pooled connection meanwhile */
+        totallen = relay_response(clientfd, connfd, &resp, cache_buf, &keep,
+                                  f, uri, stale != NULL, &expires);
+        if (totallen == 0 && reused && resp.state == RESP_ERROR)
+        {
+            Close(clientfd);
+            continue;
+        }
 
-    Close(clientfd);
-    Close(connfd);
+        if (resp.state == RESP_DONE && resp.keepalive)
+            upstream_put(hostname, port, clientfd);
+        else
+            Close(clientfd);
+        break;
+    }
 
-    if (totallen <= MAX_OBJECT_SIZE)            /* put into cache */
-        cache_write(cache_buf, uri, totallen);
+    /* Not modified: the stored copy is good for a while longer */
+    if (stale && resp.state == RESP_DONE && resp.status == 304)
+    {
+        expires = refresh_until(cache_buf, totallen, stale, stale_size);
+        if (hit)
+            cache_refresh(hit, expires);
+        else
+            disk_refresh(uri, expires);
+        size_t sent = send_object(connfd, stale, stale_size, request,
+                                  &keep);
+        record_request(STATS_REVALIDATED, started, sent, uri);
+        if (hit)
+            cache_served(hit, sent);
+        else
+            cache_missed(sent);
+    }
+    else
+    {
+        record_request(expires >= 0 ? STATS_MISS : STATS_BYPASS, started,
+                       totallen, uri);
+        cache_missed(totallen);
+        if (resp.state == RESP_DONE && expires >= 0 &&
+            totallen <= MAX_OBJECT_SIZE)
+            cache_fill(cache_buf, uri, totallen, expires);
+    }
+    if (hit)
+        cache_release(hit);
+    if (dhit.seg)
+        disk_release(&dhit);
+    if (f)
+    {
+        flight_finish(f, resp.state == RESP_DONE);
+        flight_release(f);
+    }
+    Free(cache_buf);
+    return keep && resp.state == RESP_DONE;
 }
 
-/* init cache */
-void cache_init()
+/*
+ * send a cached object, from memory or mapped from disk, in one write:
+ * its head up to the final CRLF, our Connection header, then the body;
+ * return the bytes written, 0 on error
+ */
+size_t send_hit(int connfd, const char *obj, size_t size, int *keep)
 {
-    totalcachesize = 0;
-    totalcachenum = 0;
-    totaltime = 0;
-    totalread = 0;
-    Sem_init(&cache_mutex, 0, 1);
-    Sem_init(&totaltime_mutex, 0, 1);
-    Sem_init(&read_mutex, 0, 1);
-    for (int i = 0; i < MAX_OBJECT_NUM; ++i)
+    size_t hsize = resp_head_size(obj, size);
+    const char *conn = resp_conn_line(*keep);
+    struct iovec iov[3] = {
+        {(char *)obj, hsize - 2},
+        {(char *)conn, strlen(conn)},
+        {(char *)obj + hsize, size - hsize},
+    };
+
+    dbg_printf("send back, len: %zu\n", size);
+    if (!hsize)
     {
-        allcache[i].empty = 1;
-        Sem_init(&allcache[i].time_mutex, 0, 1);
+        *keep = 0;
+        return rio_writen(connfd, (char *)obj, size) < 0 ? 0 : size;
     }
+    if (writev_all(connfd, iov, 3) < 0)
+        return 0;
+    return iov[0].iov_len + iov[1].iov_len + iov[2].iov_len;
 }
 
-/* Find cache block with given url, return -1 if not found */
-int cache_find(char *url)
+/*
+ * send a cached object as the request r wants it: inflated first for a
+ * client that does not take gzip, and ranges are cut out of the identity
+ * body; return the bytes written, 0 on error
+ */
+size_t send_object(int connfd, const char *obj, size_t size,
+                   const http_req *r, int *keep)
 {
-    dbg_printf("totalcachenum: %d\n", totalcachenum);
-    dbg_printf("find: %s\n", url);
-    int result = -1;
-    for (int i = 0; i < MAX_OBJECT_NUM; ++i)
+    size_t plainsize;
+    char *plain = r->gzip && !r->range ? NULL
+                                       : encode_plain(obj, size, &plainsize);
+
+    if (plain)
     {
-        if ((allcache[i].empty == 0) && (!strcmp(url, allcache[i].cache_url)))
-            result = i;
+        obj = plain;
+        size = plainsize;
     }
-    dbg_printf("%d\n", result);
-    return result;
+    size_t sent = r->range ? send_range(connfd, obj, size, r, keep)
+                           : send_hit(connfd, obj, size, keep);
+    if (plain)
+        Free(plain);
+    return sent;
 }
 
-/* Choose the evicted block, using strict LRU */
-int cache_evict(int size)
+/*
+ * send the byte range r asks for of a cached object, or all of it; return
+ * the bytes written, 0 on error
+ */
+size_t send_range(int connfd, const char *obj, size_t size,
+                  const http_req *r, int *keep)
+{
+    size_t hsize = resp_head_size(obj, size), first = 0, last = 0;
+    int range = req_range(r, obj, hsize, size - hsize, &first, &last);
+
+    if (range == RANGE_NONE)
+        return send_hit(connfd, obj, size, keep);
+    char *head = Malloc(hsize + RESP_RANGE_EXTRA);
+    struct iovec iov[2] = {
+        {head, resp_range_head(head, obj, hsize, range, first, last,
+                               size - hsize, *keep)},
+        {(char *)obj + hsize + first,
+         range == RANGE_PART ? last - first + 1 : 0},
+    };
+    dbg_printf("send range %zu-%zu of %zu\n", first, last, size - hsize);
+    size_t sent = 0;
+    if (writev_all(connfd, iov, 2) == 0)
+        sent = iov[0].iov_len + iov[1].iov_len;
+    Free(head);
+    return sent;
+}
+
+/*
+ * serve a response another request is fetching, as it arrives, for a
+ * request that started at started; return whether the client connection
+ * stays open, or -1 if the flight failed before sending anything so that
+ * we should fetch it ourselves
+ */
+int follow_flight(int connfd, flight *f, int keep, long started)
 {
-    /* Empty block available and cache size available */
-    if (totalcachesize + size <= MAX_CACHE_SIZE && 
-                        totalcachenum < MAX_OBJECT_NUM)
+    flight_cursor cur = {NULL, 0};
+    const char *buf;
+    size_t n;
+
+    if (flight_wait_head(f, 1) <= 0)
+        return -1;
+    trace_mark(TRACE_FIRST);
+    keep = keep && f->framed;
+
+    /* The head goes out with the body bytes already there, if any */
+    const char *conn = resp_conn_line(keep);
+    struct iovec iov[3] = {
+        {f->head, f->head_size - 2},
+        {(char *)conn, strlen(conn)},
+        {NULL, 0},
+    };
+    if (flight_read(f, &cur, &buf, &n, 0) > 0)
     {
-        for (int i = 0; i < MAX_OBJECT_NUM; ++i)
-        {
-            if (allcache[i].empty == 1)
-                return i;
-        }
+        iov[2].iov_base = (char *)buf;
+        iov[2].iov_len = n;
+        cur.off += n;
+        cur.sent += n;
     }
+    int rc = writev_all(connfd, iov, 3);
 
-    int mintime = 1 << 30, minplace = -1;
-    for (int i = 0; i < MAX_OBJECT_NUM; ++i)
+    while (rc >= 0 && flight_read(f, &cur, &buf, &n, 1) > 0)
     {
-        if (allcache[i].empty == 0)
-        {
-            P(&allcache[i].time_mutex);
-            if (allcache[i].lutime < mintime)
-            {
-                mintime = allcache[i].lutime;
-                minplace = i;
-            }
-            V(&allcache[i].time_mutex);
-        }
+        rc = rio_writen(connfd, (char *)buf, n);
+        cur.off += n;
+        cur.sent += n;
     }
+    flight_leave(f, &cur);
+    cache_missed(f->head_size + cur.sent);
+    record_request(STATS_COALESCED, started, f->head_size + cur.sent,
+                   f->url);
+    return rc >= 0 && keep && f->state == FLIGHT_DONE;
+}
 
-    totalcachesize -= allcache[minplace].object_size;
-    totalcachenum--;
-    allcache[minplace].empty = 1;
-    return minplace;
+/* Count a request served as outcome, and finish its trace */
+void record_request(int outcome, long started, long bytes, const char *uri)
+{
+    stats_request(outcome, started, bytes);
+    trace_end(outcome, bytes, uri);
 }
 
-/* 
- * Read and copy cache (given url), return the length of copied buf;
- * return -1 if cache miss
+/*
+ * get one response from end server and send to the client, copying it
+ * into cache_buf while it fits; return the size of response as cached,
+ * without the hop-by-hop headers, and set until when it is fresh in
+ * *expires.  The client connection is kept (*keep) only if the response
+ * does not end by closing the connection.  A response that may be cached
+ * is published to the followers of f, if any, and a large one is written
+ * to the disk tier as uri.  When revalidating, a 304 is only read into
+ * cache_buf: the caller sends the stored copy instead.
  */
-int cache_read(char *dest_buf, char *url)
+int relay_response(int serverfd, int connfd, http_resp *resp,
+                   char *cache_buf, int *keep, flight *f, char *uri,
+                   int revalidate, long *expires)
 {
-    P(&read_mutex);
-    totalread++;
-    if (totalread == 1)
-        P(&cache_mutex);
-    V(&read_mutex);
-
-    int id = cache_find(url);
-    if (id == -1)               /* cache miss */
+    disk_writer *dw = NULL;
+    char buf[MAXLINE];
+    char *head = Malloc(RESP_HEAD + RESP_CONN_EXTRA);
+    size_t headlen = 0;
+    int head_done = 0;
+    int totallen = 0;
+
+    dbg_printf("get HTTP response start\n");
+    resp_init(resp);
+    while (resp->state != RESP_DONE && resp->state != RESP_ERROR)
     {
-        P(&read_mutex);
-        totalread--;
-        if (totalread == 0)
-            V(&cache_mutex);
-        V(&read_mutex);
-        return -1;
-    }
+        ssize_t n = read(serverfd, buf, MAXLINE);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            resp_eof(resp);
+            break;
+        }
 
-    int len = allcache[id].object_size;
-    memcpy(dest_buf, allcache[id].cache_obj, allcache[id].object_size);
-    
-    /* Update time stamp */
-    P(&totaltime_mutex);
-    totaltime++;
-    P(&allcache[id].time_mutex);
-    allcache[id].lutime = totaltime;
-    V(&allcache[id].time_mutex);
-    V(&totaltime_mutex);
-
-    P(&read_mutex);
-    totalread--;
-    if (totalread == 0)
-        V(&cache_mutex);
-    V(&read_mutex);
-
-    return len;
-}
+        if (!head_done && !headlen)
+            trace_mark(TRACE_FIRST);
 
-/* Write new cache block */
-void cache_write(char *buf, char *url, int size)
-{
-    P(&cache_mutex);
-
-    /* find eviction(s) */
-    int evict = cache_evict(size);
-    while (totalcachesize + size > MAX_CACHE_SIZE)
-        evict = cache_evict(size);
-
-    /* update */
-    totalcachesize += size;
-    totalcachenum++;
-
-    allcache[evict].empty = 0;
-    memcpy(allcache[evict].cache_obj, buf, size);
-    strcpy(allcache[evict].cache_url, url);
-    allcache[evict].object_size = size;
-
-    /* Update time stamp */
-    P(&totaltime_mutex);
-    totaltime++;
-    /* Since we have one writer and no reader here, it is no need to lock */
-    allcache[evict].lutime = totaltime;
-    V(&totaltime_mutex);
-
-    V(&cache_mutex);
-}
\ No newline at end of file
+        /* Bytes past the end of the response: do not reuse */
+        int len = resp_parse(resp, buf, n);
+        if (len < n)
+            resp->keepalive = 0;
+
+        /* Collect the head, then send it rewritten */
+        char *body = buf;
+        if (!head_done)
+        {
+            size_t take = resp->header_len - headlen;
+            if (resp->state == RESP_ERROR || headlen + take > RESP_HEAD)
+            {
+                resp->state = RESP_ERROR;
+                break;
+            }
+            memcpy(head + headlen, buf, take);
+            headlen += take;
+            if (resp->state == RESP_HEADERS)
+                continue;
+
+            head_done = 1;
+            headlen = resp_strip_head(head, headlen);
+            if (headlen <= MAX_OBJECT_SIZE)
+                memcpy(cache_buf, head, headlen);
+            totallen = headlen;
+            if (revalidate && resp->status == 304)
+                break;
+            *expires = fresh_until(head, headlen);
+            /* Not to be cached, so not to be shared: followers fetch it */
+            if (f && *expires < 0)
+                flight_finish(f, 0);
+            else if (f)
+                flight_head(f, head, headlen, resp->state != RESP_BODY_EOF);
+            if (resp->state == RESP_BODY_LENGTH && *expires >= 0 &&
+                (dw = disk_reserve(uri, headlen + resp->content_length,
+                                   *expires)))
+                disk_append(dw, head, headlen);
+
+            /* Rewritten head and the first body bytes in one write */
+            *keep = *keep && resp->state != RESP_BODY_EOF;
+            body += take;
+            len -= take;
+            struct iovec iov[2] = {
+                {head, resp_head_conn(head, head, headlen, *keep)},
+                {body, len},
+            };
+            writev_all(connfd, iov, 2);
+        }
+        else
+            Rio_writen(connfd, body, len);
+        if (f)
+            flight_append(f, body, len);
+        if (dw)
+            disk_append(dw, body, len);
+        dbg_printf("reponse size:%d\n", len);
+        totallen += len;
+        if (totallen <= MAX_OBJECT_SIZE)
+            memcpy(cache_buf + (totallen - len), body, len);
+    }
+    dbg_printf("get HTTP response end\n");
+    if (dw)
+        disk_commit(dw, resp->state == RESP_DONE);
+    Free(head);
+    return totallen;
+}
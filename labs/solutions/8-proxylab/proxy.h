@@ -0,0 +1,66 @@
+/*
+ * proxy.h - definitions shared by the threaded proxy (proxy.c) and the
+ * event-driven engine (event.c)
+ */
+#ifndef __PROXY_H__
+#define __PROXY_H__
+
+#include "csapp.h"
+#include "http.h"
+
+/* If you want debugging output, use the following macro.  When you hand
+ * in, remove the #define DEBUG line. */
+/* #define DEBUG */
+#ifdef DEBUG
+#define dbg_printf(...) printf(__VA_ARGS__)
+#else
+#define dbg_printf(...)
+#endif
+
+/* Longest request line plus headers the proxy forwards */
+#define MAX_REQUEST (4 * MAXLINE)
+
+/* Room for such a request as rewritten for the end server, conditional */
+#define MAX_UPSTREAM (MAX_REQUEST + MAXLINE + RESP_CONDITIONAL)
+
+/* Some string constants, defined in proxy.c */
+extern char *user_agent_hdr;
+extern char *connection_hdr;
+extern char *proxy_hdr;
+extern char *encoding_hdr;
+extern char *https_res;
+
+/* Client keep-alive limits, set from the command line */
+extern int client_timeout;      /* seconds a client may stay idle */
+extern int client_requests;     /* requests served per client connection */
+
+/* Whether tunnels move bytes with splice() rather than copying them */
+extern int tunnel_splice;
+extern int tunnel_timeout;      /* seconds a tunnel may stay idle */
+
+/* Seconds a response that does not tell stays fresh, from the command line */
+extern int freshness;
+
+/* the request sent to the end server, by both engines */
+#define OWN_HEADERS 5
+size_t build_request(const http_req *r, char *out, const char *cond);
+int build_request_iov(const http_req *r, struct iovec *iov, const char *cond);
+
+/* Whether compressible objects are cached as their gzip variant */
+extern int cache_gzip;
+
+/* filling the cache, by both engines */
+void cache_fill(char *obj, char *uri, int size, long expires);
+
+/* freshness of responses, by both engines */
+long fresh_until(const char *head, size_t n);
+long refresh_until(const char *head, size_t n, const char *obj, size_t size);
+
+/* event-driven engine: serve listenfd from nloops epoll threads */
+void event_run(int listenfd, int nloops);
+
+/* event loops relaying the tunnels of the threaded engine */
+void event_tunnels(int nloops);
+void event_tunnel(int clientfd, int serverfd, char *pending, size_t len);
+
+#endif /* __PROXY_H__ */
@@ -0,0 +1,68 @@
+/*
+ * sbuf.c - bounded FIFO of descriptors (the CS:APP producer-consumer
+ * package), extended with a non-blocking insert for overload handling
+ */
+#include "csapp.h"
+#include "sbuf.h"
+
+/* Create an empty, bounded, shared FIFO buffer with n slots */
+void sbuf_init(sbuf_t *sp, int n)
+{
+    sp->buf = Calloc(n, sizeof(int));
+    sp->n = n;
+    sp->front = sp->rear = 0;
+    Sem_init(&sp->mutex, 0, 1);
+    Sem_init(&sp->slots, 0, n);
+    Sem_init(&sp->items, 0, 0);
+}
+
+/* Clean up buffer sp */
+void sbuf_deinit(sbuf_t *sp)
+{
+    Free(sp->buf);
+}
+
+/* Insert item onto the rear of shared buffer sp, waiting for a slot */
+void sbuf_insert(sbuf_t *sp, int item)
+{
+    P(&sp->slots);
+    P(&sp->mutex);
+    sp->buf[(++sp->rear) % (sp->n)] = item;
+    V(&sp->mutex);
+    V(&sp->items);
+}
+
+/* 
+ * Insert item onto the rear of shared buffer sp without waiting,
+ * return -1 (and leave sp untouched) if the buffer is full
+ */
+int sbuf_tryinsert(sbuf_t *sp, int item)
+{
+    while (sem_trywait(&sp->slots) < 0)
+    {
+        if (errno == EAGAIN)
+            return -1;
+        if (errno != EINTR)
+        {
+            unix_error("sem_trywait error");
+            return -1;
+        }
+    }
+    P(&sp->mutex);
+    sp->buf[(++sp->rear) % (sp->n)] = item;
+    V(&sp->mutex);
+    V(&sp->items);
+    return 0;
+}
+
+/* Remove and return the first item from buffer sp */
+int sbuf_remove(sbuf_t *sp)
+{
+    int item;
+    P(&sp->items);
+    P(&sp->mutex);
+    item = sp->buf[(++sp->front) % (sp->n)];
+    V(&sp->mutex);
+    V(&sp->slots);
+    return item;
+}
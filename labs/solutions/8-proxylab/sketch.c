@@ -0,0 +1,88 @@
+/*
+ * sketch.c - count-min sketch of access frequencies
+ *
+ * A key is counted in one small counter of each of SKETCH_ROWS rows,
+ * picked by a differently seeded hash per row, and its estimate is the
+ * smallest of them: collisions can only make a key look more popular.
+ * Only the counters at that minimum are incremented (conservative
+ * update), which keeps the overestimates small.
+ *
+ * Counters saturate at SKETCH_MAX, and every sample additions all of
+ * them are halved, so the estimates follow recent popularity instead of
+ * all-time counts.  Updates are relaxed atomic byte stores from any
+ * thread; an increment lost to a race only makes an estimate a little
+ * low, which is fine for an admission heuristic.
+ */
+#include "csapp.h"
+#include "sketch.h"
+
+/* Additions per counter of a row between two halvings */
+#define SKETCH_SAMPLE 10
+
+static const unsigned int seeds[SKETCH_ROWS] = {
+    0x9e3779b9u, 0x85ebca6bu, 0xc2b2ae35u, 0x27d4eb2fu,
+};
+
+static unsigned char *counter(sketch *s, unsigned int hash, int row);
+static void sketch_age(sketch *s);
+
+/* init s with rows of width counters, rounded up to a power of two */
+void sketch_init(sketch *s, int width)
+{
+    unsigned int w = 64;
+    while (w < width)
+        w *= 2;
+    s->table = Calloc((size_t)w * SKETCH_ROWS, 1);
+    s->mask = w - 1;
+    s->additions = 0;
+    s->sample = (long)w * SKETCH_SAMPLE;
+}
+
+static unsigned char *counter(sketch *s, unsigned int hash, int row)
+{
+    unsigned int h = (hash ^ seeds[row]) * 0x9e3779b1u;
+    h ^= h >> 16;
+    return &s->table[(size_t)row * (s->mask + 1) + (h & s->mask)];
+}
+
+/* Count one access to the key of hash */
+void sketch_add(sketch *s, unsigned int hash)
+{
+    int min = sketch_estimate(s, hash);
+    if (min < SKETCH_MAX)
+    {
+        for (int row = 0; row < SKETCH_ROWS; ++row)
+        {
+            unsigned char *c = counter(s, hash, row);
+            if (__atomic_load_n(c, __ATOMIC_RELAXED) == min)
+                __atomic_store_n(c, min + 1, __ATOMIC_RELAXED);
+        }
+    }
+    if (__atomic_add_fetch(&s->additions, 1, __ATOMIC_RELAXED) == s->sample)
+        sketch_age(s);
+}
+
+/* How often the key of hash was seen recently, at most SKETCH_MAX */
+int sketch_estimate(sketch *s, unsigned int hash)
+{
+    int min = SKETCH_MAX;
+    for (int row = 0; row < SKETCH_ROWS; ++row)
+    {
+        int c = __atomic_load_n(counter(s, hash, row), __ATOMIC_RELAXED);
+        if (c < min)
+            min = c;
+    }
+    return min;
+}
+
+/* Halve every counter, by the thread whose addition completed a sample */
+static void sketch_age(sketch *s)
+{
+    size_t n = (size_t)(s->mask + 1) * SKETCH_ROWS;
+    for (size_t i = 0; i < n; ++i)
+    {
+        unsigned char c = __atomic_load_n(&s->table[i], __ATOMIC_RELAXED);
+        __atomic_store_n(&s->table[i], c >> 1, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&s->additions, s->sample / 2, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,22 @@
+/*
+ * sketch.h - count-min sketch of access frequencies
+ */
+#ifndef __SKETCH_H__
+#define __SKETCH_H__
+
+#define SKETCH_ROWS 4   /* counters per key, each in its own row */
+#define SKETCH_MAX 15   /* counters saturate here */
+
+typedef struct
+{
+    unsigned char *table;   /* SKETCH_ROWS rows of mask + 1 counters */
+    unsigned int mask;
+    long additions;         /* since the counters were last halved */
+    long sample;            /* additions between two halvings */
+} sketch;
+
+void sketch_init(sketch *s, int width);
+void sketch_add(sketch *s, unsigned int hash);
+int sketch_estimate(sketch *s, unsigned int hash);
+
+#endif /* __SKETCH_H__ */
@@ -0,0 +1,260 @@
+/*
+ * snapshot.c - cache snapshot for warm restarts
+ *
+ * With -S path, the memory cache is written to path when the proxy gets
+ * SIGUSR1, and once more before it exits on SIGINT or SIGTERM (see the
+ * signal thread of proxy.c).  The next proxy started with the same path
+ * maps that snapshot and serves from it right away instead of starting
+ * cold.
+ *
+ * A snapshot is laid out to be used in place, in native byte order:
+ *   snap_header     magic, format version, number of objects, file size
+ *   snap_entry[n]   the index, sorted by url hash, with the time each
+ *                   object stays fresh
+ *   data            the url, a NUL and the object bytes of every entry
+ *
+ * Loading only checks the header and maps the file, so startup reads
+ * nothing else.  A cache miss binary searches the mapped index for its url
+ * and, when found, copies the object into the cache, where it is subject to
+ * the eviction policy like any other.  An entry is taken once the cache
+ * admitted its object, and only then: an object evicted later is not
+ * brought back from the older copy, while one the admission policy turned
+ * away is tried again on the next miss.  The mapping lives as long as the
+ * proxy; its pages are clean and the kernel drops them once they are no
+ * longer used.  Entries nobody asked for yet are carried over into the next
+ * snapshot, so two quick restarts in a row lose nothing.
+ *
+ * A snapshot is written to path.tmp and renamed over path, so a crash
+ * while saving leaves the previous one intact.
+ */
+#include "csapp.h"
+#include "proxy.h"
+#include "cache.h"
+#include "snapshot.h"
+#include <stdint.h>
+
+typedef struct
+{
+    char magic[8];              /* SNAPSHOT_MAGIC */
+    uint32_t version;           /* SNAPSHOT_VERSION */
+    uint32_t count;             /* number of objects */
+    uint64_t size;              /* bytes of the whole file */
+    int64_t saved;              /* when it was taken */
+} snap_header;
+
+typedef struct
+{
+    uint32_t hash;              /* cache_hash(url) */
+    uint32_t urllen;
+    uint32_t size;              /* object bytes */
+    uint32_t unused;
+    uint64_t off;               /* where the url starts */
+    int64_t expires;            /* fresh until then */
+} snap_entry;
+
+/* An object to save, from the cache or from the loaded snapshot */
+typedef struct
+{
+    unsigned int hash;
+    const char *url;
+    size_t urllen;
+    const char *obj;
+    size_t size;
+    long expires;
+} snap_object;
+
+static const char *map;         /* the loaded snapshot, NULL if none */
+static size_t map_size;
+static const snap_entry *entries;
+static uint32_t nentries;
+static char *taken;             /* entries already moved to the cache */
+
+static int by_hash(const void *a, const void *b);
+
+/* Map the snapshot at path; a missing or unusable one is ignored */
+void snapshot_load(char *path)
+{
+    struct stat st;
+    const snap_header *h;
+    void *m;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+    {
+        if (errno != ENOENT)
+            fprintf(stderr, "snapshot %s: %s\n", path, strerror(errno));
+        return;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size < sizeof(snap_header))
+    {
+        close(fd);
+        fprintf(stderr, "snapshot %s: too short, ignored\n", path);
+        return;
+    }
+    m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED)
+    {
+        fprintf(stderr, "snapshot %s: %s\n", path, strerror(errno));
+        return;
+    }
+
+    h = m;
+    if (memcmp(h->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) ||
+        h->version != SNAPSHOT_VERSION || h->size != st.st_size ||
+        h->count > (st.st_size - sizeof(snap_header)) / sizeof(snap_entry))
+    {
+        fprintf(stderr, "snapshot %s: not a version %d snapshot, ignored\n",
+                path, SNAPSHOT_VERSION);
+        munmap(m, st.st_size);
+        return;
+    }
+    map = m;
+    map_size = st.st_size;
+    entries = (const snap_entry *)(map + sizeof(snap_header));
+    nentries = h->count;
+    taken = Calloc(nentries + 1, 1);
+    dbg_printf("snapshot %s: %u objects, %ld seconds old\n", path, nentries,
+               (long)(time(NULL) - h->saved));
+}
+
+/*
+ * On a cache miss for url: if the snapshot has it and nobody took it
+ * yet, point *obj and *size at its bytes, set when it expires and return
+ * the index of its entry, otherwise -1
+ */
+int snapshot_find(const char *url, unsigned int hash,
+                  const char **obj, int *size, long *expires)
+{
+    uint32_t lo = 0, hi = nentries;
+    size_t urllen = strlen(url);
+
+    if (!map)
+        return -1;
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (entries[mid].hash < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (; lo < nentries && entries[lo].hash == hash; ++lo)
+    {
+        const snap_entry *e = &entries[lo];
+        if (e->urllen != urllen || e->off > map_size ||
+            e->urllen + 1 + (uint64_t)e->size > map_size - e->off ||
+            memcmp(map + e->off, url, urllen))
+            continue;
+        if (__atomic_load_n(&taken[lo], __ATOMIC_RELAXED))
+            return -1;
+        *obj = map + e->off + urllen + 1;
+        *size = e->size;
+        *expires = e->expires;
+        return lo;
+    }
+    return -1;
+}
+
+/* The entry i of snapshot_find() is in the cache now, not to be taken again */
+void snapshot_take(int i)
+{
+    __atomic_store_n(&taken[i], 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Write every object of the cache, and those of the loaded snapshot
+ * still waiting for a request, to path; return -1 on error
+ */
+int snapshot_save(char *path)
+{
+    cache_block **blocks;
+    int nblocks = cache_collect(&blocks), n = 0, ok;
+    snap_object *objs = Malloc((nblocks + nentries + 1) * sizeof(snap_object));
+    char tmp[MAXLINE];
+    snap_header h;
+    snap_entry e;
+    uint64_t off, data;
+    FILE *fp;
+
+    for (int i = 0; i < nblocks; ++i, ++n)
+    {
+        objs[n].hash = blocks[i]->hash;
+        objs[n].url = blocks[i]->cache_url;
+        objs[n].urllen = strlen(blocks[i]->cache_url);
+        objs[n].obj = blocks[i]->cache_obj;
+        objs[n].size = blocks[i]->object_size;
+        objs[n].expires = __atomic_load_n(&blocks[i]->expires,
+                                          __ATOMIC_RELAXED);
+    }
+    for (uint32_t i = 0; i < nentries; ++i)
+    {
+        const snap_entry *le = &entries[i];
+        if (__atomic_load_n(&taken[i], __ATOMIC_RELAXED) ||
+            le->off > map_size ||
+            le->urllen + 1 + (uint64_t)le->size > map_size - le->off)
+            continue;
+        objs[n].hash = le->hash;
+        objs[n].url = map + le->off;
+        objs[n].urllen = le->urllen;
+        objs[n].obj = map + le->off + le->urllen + 1;
+        objs[n].size = le->size;
+        objs[n].expires = le->expires;
+        n++;
+    }
+    qsort(objs, n, sizeof(snap_object), by_hash);
+
+    data = sizeof(snap_header) + n * sizeof(snap_entry);
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    h.version = SNAPSHOT_VERSION;
+    h.count = n;
+    h.saved = time(NULL);
+    h.size = data;
+    for (int i = 0; i < n; ++i)
+        h.size += objs[i].urllen + 1 + objs[i].size;
+
+    snprintf(tmp, MAXLINE, "%s.tmp", path);
+    ok = (fp = fopen(tmp, "w")) != NULL;
+    if (ok)
+    {
+        fwrite(&h, sizeof(h), 1, fp);
+        memset(&e, 0, sizeof(e));
+        off = data;
+        for (int i = 0; i < n; ++i)
+        {
+            e.hash = objs[i].hash;
+            e.urllen = objs[i].urllen;
+            e.size = objs[i].size;
+            e.off = off;
+            e.expires = objs[i].expires;
+            fwrite(&e, sizeof(e), 1, fp);
+            off += e.urllen + 1 + e.size;
+        }
+        for (int i = 0; i < n; ++i)
+        {
+            fwrite(objs[i].url, objs[i].urllen, 1, fp);
+            fputc('\0', fp);
+            fwrite(objs[i].obj, objs[i].size, 1, fp);
+        }
+        ok = !fflush(fp) && !ferror(fp) && !fsync(fileno(fp));
+        ok = !fclose(fp) && ok && !rename(tmp, path);
+        if (!ok)
+            unlink(tmp);
+    }
+
+    dbg_printf("snapshot %s: %d objects, %s\n", path, n, ok ? "ok" : "failed");
+    for (int i = 0; i < nblocks; ++i)
+        cache_release(blocks[i]);
+    Free(blocks);
+    Free(objs);
+    return ok ? 0 : -1;
+}
+
+/* Order of the index */
+static int by_hash(const void *a, const void *b)
+{
+    unsigned int ha = ((const snap_object *)a)->hash;
+    unsigned int hb = ((const snap_object *)b)->hash;
+    return ha < hb ? -1 : ha > hb;
+}
@@ -0,0 +1,17 @@
+/*
+ * snapshot.h - cache snapshot for warm restarts
+ */
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+/* First bytes and format version of a snapshot file */
+#define SNAPSHOT_MAGIC "PXYSNAP"
+#define SNAPSHOT_VERSION 2
+
+void snapshot_load(char *path);
+int snapshot_save(char *path);
+int snapshot_find(const char *url, unsigned int hash,
+                  const char **obj, int *size, long *expires);
+void snapshot_take(int i);
+
+#endif /* __SNAPSHOT_H__ */
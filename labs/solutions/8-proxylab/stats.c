@@ -0,0 +1,275 @@
+/*
+ * stats.c - live statistics of the proxy, served as JSON
+ *
+ * GET http://proxy.local/__stats is answered by the proxy itself with
+ * what it did since it started: requests by how they were served and
+ * their rates, bytes from the cache and from end servers, the counters
+ * of the cache, open client connections and tunnels, time spent waiting
+ * for cache locks, and a latency histogram per kind of request.
+ *
+ * Every thread counts into a block of its own, registered the first time
+ * it counts anything, and is the only one to write it: no lock and no
+ * shared cache line on the paths being measured.  The stores are relaxed
+ * atomics so that a reader summing all the blocks sees whole values.  A
+ * gauge, like the number of open connections, may go up in one thread
+ * and down in another; only the sum over all blocks means anything.
+ */
+#include "csapp.h"
+#include "proxy.h"
+#include "cache.h"
+#include "stats.h"
+#include <stdarg.h>
+
+/* Room for the JSON document */
+#define STATS_JSON 16384
+
+/* Cache line size, to keep the blocks of two threads apart */
+#define STATS_ALIGN 64
+
+/* Counters of one thread */
+typedef struct stats_block
+{
+    long requests[STATS_OUTCOMES];
+    long bytes[STATS_OUTCOMES];
+    long latency[STATS_OUTCOMES][STATS_BUCKETS];
+    long connections;           /* opened minus closed by this thread */
+    long tunnels;               /* same for tunnels */
+    long tunnels_opened;
+    long lock_waits, lock_wait_ns;
+    struct stats_block *next;
+} __attribute__((aligned(STATS_ALIGN))) stats_block;
+
+/* Everything summed over the blocks */
+typedef stats_block stats_sum;
+
+static const char *const outcome_names[STATS_OUTCOMES] = {
+    NULL, "hit", "revalidated", "miss", "bypass", "coalesced",
+};
+
+static __thread stats_block *mine;  /* block of the calling thread */
+static stats_block *blocks;         /* all of them */
+static sem_t blocks_mutex;          /* registration, and the last scrape */
+static long started_ns;             /* when the proxy started */
+static long last_ns, last_requests; /* when last asked, and the total */
+
+static stats_block *my_block(void);
+static void bump(long *counter, long n);
+static void collect(stats_sum *s);
+static int bucket_of(long ns);
+static long percentile(const long *hist, long count, double p);
+static void out(char *buf, size_t *len, const char *fmt, ...);
+
+void stats_init(void)
+{
+    Sem_init(&blocks_mutex, 0, 1);
+    started_ns = last_ns = stats_now();
+}
+
+/* Nanoseconds of the monotonic clock */
+long stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* Count a request that started at started and sent bytes of object */
+void stats_request(int outcome, long started, long bytes)
+{
+    stats_block *b = my_block();
+
+    if (outcome <= STATS_NONE || outcome >= STATS_OUTCOMES)
+        return;
+    bump(&b->requests[outcome], 1);
+    bump(&b->bytes[outcome], bytes);
+    bump(&b->latency[outcome][bucket_of(stats_now() - started)], 1);
+}
+
+/* A client connection opened (1) or closed (-1) */
+void stats_connection(int delta)
+{
+    bump(&my_block()->connections, delta);
+}
+
+/* A tunnel opened (1) or closed (-1) */
+void stats_tunnel(int delta)
+{
+    stats_block *b = my_block();
+    bump(&b->tunnels, delta);
+    if (delta > 0)
+        bump(&b->tunnels_opened, delta);
+}
+
+/* A cache lock was busy, and taking it took ns */
+void stats_lock_wait(long ns)
+{
+    stats_block *b = my_block();
+    bump(&b->lock_waits, 1);
+    bump(&b->lock_wait_ns, ns);
+}
+
+/* Name of an outcome, as in the JSON document */
+const char *stats_outcome(int outcome)
+{
+    if (outcome <= STATS_NONE || outcome >= STATS_OUTCOMES)
+        return "none";
+    return outcome_names[outcome];
+}
+
+/* Whether r asks for the statistics */
+int stats_is_request(const http_req *r)
+{
+    return str_is(r->host, STATS_HOST) && str_is(r->path, STATS_PATH);
+}
+
+/*
+ * The statistics as a response to send, in the form of a stored object:
+ * malloc'ed, its size in *size
+ */
+char *stats_response(size_t *size)
+{
+    char *json = Malloc(STATS_JSON);
+    size_t len = 0;
+    stats_sum s;
+    cache_totals t;
+    long now = stats_now(), total = 0, recent, since;
+
+    collect(&s);
+    cache_stats(&t);
+    for (int i = STATS_NONE + 1; i < STATS_OUTCOMES; ++i)
+        total += s.requests[i];
+
+    P(&blocks_mutex);
+    recent = total - last_requests;
+    since = now - last_ns;
+    last_requests = total;
+    last_ns = now;
+    V(&blocks_mutex);
+
+    double uptime = (now - started_ns) / 1e9;
+    out(json, &len, "{\"uptime\": %.3f, ", uptime);
+    out(json, &len, "\"requests\": {\"total\": %ld", total);
+    for (int i = STATS_NONE + 1; i < STATS_OUTCOMES; ++i)
+        out(json, &len, ", \"%s\": %ld", outcome_names[i], s.requests[i]);
+    out(json, &len, "}, \"rate\": {\"overall\": %.2f, \"recent\": %.2f}, ",
+        uptime > 0 ? total / uptime : 0.0,
+        since > 0 ? recent / (since / 1e9) : 0.0);
+    out(json, &len, "\"bytes\": {\"cache\": %ld, \"upstream\": %ld}, ",
+        s.bytes[STATS_HIT] + s.bytes[STATS_REVALIDATED],
+        s.bytes[STATS_MISS] + s.bytes[STATS_BYPASS] +
+            s.bytes[STATS_COALESCED]);
+    out(json, &len, "\"cache\": {\"objects\": %ld, \"bytes\": %ld, "
+                    "\"hits\": %ld, \"misses\": %ld, \"stale\": %ld, "
+                    "\"inserted\": %ld, \"admitted\": %ld, "
+                    "\"rejected\": %ld, \"evicted\": %ld}, ",
+        t.objects, t.bytes, t.hits, t.misses, t.stale, t.inserted,
+        t.admitted, t.rejected, t.evicted);
+    out(json, &len, "\"connections\": %ld, ", s.connections);
+    out(json, &len, "\"tunnels\": {\"open\": %ld, \"total\": %ld}, ",
+        s.tunnels, s.tunnels_opened);
+    out(json, &len, "\"lock_wait\": {\"count\": %ld, \"total_us\": %ld}, ",
+        s.lock_waits, s.lock_wait_ns / 1000);
+
+    /* Percentiles are the upper bounds of their buckets */
+    out(json, &len, "\"latency_us\": {");
+    for (int i = STATS_NONE + 1; i < STATS_OUTCOMES; ++i)
+    {
+        long n = s.requests[i];
+        out(json, &len, "%s\"%s\": {\"count\": %ld, \"p50\": %ld, "
+                        "\"p90\": %ld, \"p99\": %ld, \"buckets\": [",
+            i > STATS_NONE + 1 ? ", " : "", outcome_names[i], n,
+            percentile(s.latency[i], n, 0.5),
+            percentile(s.latency[i], n, 0.9),
+            percentile(s.latency[i], n, 0.99));
+        for (int j = 0; j < STATS_BUCKETS; ++j)
+            out(json, &len, "%s%ld", j ? ", " : "", s.latency[i][j]);
+        out(json, &len, "]}");
+    }
+    out(json, &len, "}}\n");
+
+    char *obj = Malloc(len + MAXLINE);
+    *size = sprintf(obj, "HTTP/1.1 200 OK\r\n"
+                         "Content-Type: application/json\r\n"
+                         "Cache-Control: no-store\r\n"
+                         "Content-Length: %zu\r\n\r\n", len);
+    memcpy(obj + *size, json, len);
+    *size += len;
+    Free(json);
+    return obj;
+}
+
+/* The block of the calling thread, registered on first use */
+static stats_block *my_block(void)
+{
+    if (mine)
+        return mine;
+    if (posix_memalign((void **)&mine, STATS_ALIGN, sizeof(stats_block)))
+        unix_error("posix_memalign error");
+    memset(mine, 0, sizeof(stats_block));
+    P(&blocks_mutex);
+    mine->next = blocks;
+    blocks = mine;
+    V(&blocks_mutex);
+    return mine;
+}
+
+/* Add n to a counter only the calling thread writes */
+static void bump(long *counter, long n)
+{
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n,
+                     __ATOMIC_RELAXED);
+}
+
+/* Sum every block into s */
+static void collect(stats_sum *s)
+{
+    long *sum = (long *)s;
+    size_t n = offsetof(stats_block, next) / sizeof(long);
+
+    memset(s, 0, sizeof(stats_sum));
+    P(&blocks_mutex);
+    for (stats_block *b = blocks; b; b = b->next)
+    {
+        const long *c = (const long *)b;
+        for (size_t i = 0; i < n; ++i)
+            sum[i] += __atomic_load_n(&c[i], __ATOMIC_RELAXED);
+    }
+    V(&blocks_mutex);
+}
+
+/* Histogram bucket of a latency of ns */
+static int bucket_of(long ns)
+{
+    long us = ns / 1000;
+    int i = us < 2 ? 0 : 63 - __builtin_clzl(us);
+    return i < STATS_BUCKETS ? i : STATS_BUCKETS - 1;
+}
+
+/* Upper bound in microseconds of the bucket holding the p quantile */
+static long percentile(const long *hist, long count, double p)
+{
+    long seen = 0;
+
+    if (!count)
+        return 0;
+    for (int i = 0; i < STATS_BUCKETS; ++i)
+    {
+        seen += hist[i];
+        if (seen >= p * count)
+            return 2L << i;
+    }
+    return 2L << (STATS_BUCKETS - 1);
+}
+
+/* Append to the JSON document in buf, as long as there is room */
+static void out(char *buf, size_t *len, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(buf + *len, STATS_JSON - *len, fmt, ap);
+    va_end(ap);
+    if (n > 0)
+        *len = *len + n < STATS_JSON ? *len + n : STATS_JSON - 1;
+}
@@ -0,0 +1,39 @@
+/*
+ * stats.h - live statistics of the proxy, served as JSON
+ */
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stddef.h>
+#include "http.h"
+
+/* The url a client asks for the statistics with */
+#define STATS_HOST "proxy.local"
+#define STATS_PATH "/__stats"
+
+/* Latency histogram buckets: [2^i, 2^(i+1)) microseconds, the first from 0 */
+#define STATS_BUCKETS 32
+
+/* How a request was served */
+enum
+{
+    STATS_NONE,             /* no request, or not one to count */
+    STATS_HIT,              /* fresh copy from memory or disk */
+    STATS_REVALIDATED,      /* stale copy the end server confirmed */
+    STATS_MISS,             /* fetched, and cacheable */
+    STATS_BYPASS,           /* fetched, but not to be cached */
+    STATS_COALESCED,        /* relayed from another request's fetch */
+    STATS_OUTCOMES
+};
+
+void stats_init(void);
+long stats_now(void);
+void stats_request(int outcome, long started, long bytes);
+void stats_connection(int delta);
+void stats_tunnel(int delta);
+void stats_lock_wait(long ns);
+const char *stats_outcome(int outcome);
+int stats_is_request(const http_req *r);
+char *stats_response(size_t *size);
+
+#endif /* __STATS_H__ */
@@ -0,0 +1,263 @@
+/*
+ * trace.c - per-request phase latency traces
+ *
+ * With -T, every request (or one in -x of them) leaves a record of when
+ * it went through each phase, from the accept of its connection to the
+ * last byte written to the client, so that a slow request tells where
+ * its time went.  The thread serving a request fills the record in
+ * place through trace_mark(), which marks the current record of the
+ * thread: code deep down, like dns_clientfd(), marks a phase without
+ * being handed the record.  The event engine makes the record of a
+ * connection current while it drives it.
+ *
+ * A finished record goes into a ring only its thread writes and only the
+ * drain thread reads: no lock, each side publishes its index with a
+ * release store.  The drain thread empties every ring into the file each
+ * TRACE_DRAIN_MS; a record finding its ring full is dropped and counted
+ * rather than waited for, so tracing never holds a request up.
+ */
+#include "csapp.h"
+#include "cache.h"
+#include "stats.h"
+#include "trace.h"
+
+/* Cache line size, to keep the indices of the two sides apart */
+#define TRACE_ALIGN 64
+
+/* Records of one thread on their way to the file */
+typedef struct trace_ring
+{
+    trace_record slots[TRACE_RING];
+    unsigned long head;         /* records pushed, by the owner */
+    unsigned long tail __attribute__((aligned(TRACE_ALIGN)));
+                                /* records written, by the drain thread */
+    long dropped;               /* found the ring full */
+    int index;
+    struct trace_ring *next;
+} trace_ring;
+
+static const char *const phase_names[TRACE_PHASES] = {
+    "worker", "parsed", "lookup", "dns", "connect", "sent", "first", "done",
+};
+
+static int trace_every;             /* trace one request in that many, 0 off */
+static FILE *trace_fp;
+static int trace_text;              /* JSON lines rather than binary */
+static trace_ring *rings;           /* every thread's, pushed in front */
+static int nrings;
+static sem_t drain_mutex;           /* the drain thread, and trace_flush */
+static long *accepted;              /* accept time by descriptor */
+static long naccepted;
+
+static __thread trace_ring *ring;       /* of the calling thread */
+static __thread trace_record *current;  /* the record trace_mark() marks */
+static __thread unsigned long seen;     /* requests begun, for sampling */
+
+static void *drainer(void *vargp);
+static void drain(void);
+static void push(const trace_record *r);
+static void write_record(const trace_record *r);
+
+/*
+ * Trace one request in every to path, as JSON lines if its name ends
+ * with TRACE_JSONL, in binary otherwise; start the drain thread
+ */
+int trace_init(char *path, int every)
+{
+    size_t n = strlen(path), m = strlen(TRACE_JSONL);
+    pthread_t tid;
+
+    if (!(trace_fp = fopen(path, "w")))
+    {
+        fprintf(stderr, "trace %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    trace_text = n >= m && !strcmp(path + n - m, TRACE_JSONL);
+    if (!trace_text)
+    {
+        trace_header h = {TRACE_MAGIC, TRACE_VERSION, sizeof(trace_record)};
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        h.realtime = ts.tv_sec * 1000000000L + ts.tv_nsec;
+        h.monotonic = stats_now();
+        fwrite(&h, sizeof(h), 1, trace_fp);
+    }
+
+    if ((naccepted = sysconf(_SC_OPEN_MAX)) <= 0)
+        naccepted = FD_SETSIZE;
+    accepted = Calloc(naccepted, sizeof(long));
+    Sem_init(&drain_mutex, 0, 1);
+    trace_every = every;
+    Pthread_create(&tid, NULL, drainer, NULL);
+    return 0;
+}
+
+/* The connection fd was just accepted, its first request begins */
+void trace_accept(int fd)
+{
+    if (trace_every && fd < naccepted)
+        accepted[fd] = stats_now();
+}
+
+/* When fd was accepted, 0 if not known */
+long trace_accepted(int fd)
+{
+    return trace_every && fd < naccepted ? accepted[fd] : 0;
+}
+
+/*
+ * A request that began at start (now if 0) is read: record it in r if it
+ * is sampled, and make r the current record of the thread
+ */
+void trace_begin(trace_record *r, long start)
+{
+    current = NULL;
+    if (!trace_every || ++seen % trace_every)
+        return;
+    memset(r, 0, sizeof(trace_record));
+    for (int i = 0; i < TRACE_PHASES; ++i)
+        r->us[i] = TRACE_UNSET;
+    r->start = start ? start : stats_now();
+    r->live = 1;
+    current = r;
+}
+
+/* Mark the phases of r from now on, if it is being recorded */
+void trace_use(trace_record *r)
+{
+    current = r && r->live ? r : NULL;
+}
+
+/* The current request reached phase now */
+void trace_mark(int phase)
+{
+    if (current)
+        trace_mark_at(phase, stats_now());
+}
+
+/* The current request reached phase at the monotonic time when */
+void trace_mark_at(int phase, long when)
+{
+    long us;
+
+    if (!current)
+        return;
+    us = (when - (long)current->start) / 1000;
+    current->us[phase] = us < 0 ? 0 : us < TRACE_UNSET ? us : TRACE_UNSET - 1;
+}
+
+/*
+ * The current request is done: it was served as outcome from bytes of
+ * url.  Its record goes to the file unless outcome is STATS_NONE.
+ */
+void trace_end(int outcome, long bytes, const char *url)
+{
+    trace_record *r = current;
+
+    if (!r)
+        return;
+    trace_mark(TRACE_DONE);
+    current = NULL;
+    r->live = 0;
+    if (outcome == STATS_NONE)
+        return;
+    r->outcome = outcome;
+    r->bytes = bytes < UINT32_MAX ? bytes : UINT32_MAX;
+    r->hash = url ? cache_hash(url) : 0;
+    push(r);
+}
+
+/* Write out every record pushed so far, before exiting */
+void trace_flush(void)
+{
+    long dropped = 0;
+
+    if (!trace_every)
+        return;
+    drain();
+    for (trace_ring *q = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); q;
+         q = q->next)
+        dropped += __atomic_load_n(&q->dropped, __ATOMIC_RELAXED);
+    if (dropped)
+        fprintf(stderr, "trace: %ld records dropped\n", dropped);
+}
+
+static void *drainer(void *vargp)
+{
+    Pthread_detach(pthread_self());
+    while (1)
+    {
+        usleep(TRACE_DRAIN_MS * 1000);
+        drain();
+    }
+    return NULL;
+}
+
+/* Empty every ring into the file */
+static void drain(void)
+{
+    P(&drain_mutex);
+    for (trace_ring *q = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); q;
+         q = q->next)
+    {
+        unsigned long t = q->tail;
+        unsigned long h = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+        for (; t != h; ++t)
+            write_record(&q->slots[t % TRACE_RING]);
+        __atomic_store_n(&q->tail, t, __ATOMIC_RELEASE);
+    }
+    fflush(trace_fp);
+    V(&drain_mutex);
+}
+
+/* Hand r to the drain thread through the ring of the calling thread */
+static void push(const trace_record *r)
+{
+    trace_ring *q = ring;
+
+    if (!q)
+    {
+        if (posix_memalign((void **)&q, TRACE_ALIGN, sizeof(trace_ring)))
+        {
+            unix_error("posix_memalign error");
+            return;
+        }
+        memset(q, 0, sizeof(trace_ring));
+        q->index = __atomic_fetch_add(&nrings, 1, __ATOMIC_RELAXED);
+        q->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&rings, &q->next, q, 0,
+                                            __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED))
+            ;
+        ring = q;
+    }
+
+    unsigned long h = q->head;
+    if (h - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) >= TRACE_RING)
+    {
+        __atomic_store_n(&q->dropped, q->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    q->slots[h % TRACE_RING] = *r;
+    q->slots[h % TRACE_RING].thread = q->index;
+    __atomic_store_n(&q->head, h + 1, __ATOMIC_RELEASE);
+}
+
+/* One record in the file, as it is or as a line of JSON */
+static void write_record(const trace_record *r)
+{
+    if (!trace_text)
+    {
+        fwrite(r, sizeof(trace_record), 1, trace_fp);
+        return;
+    }
+    fprintf(trace_fp, "{\"start\": %lu, \"thread\": %u, \"outcome\": \"%s\", "
+                      "\"bytes\": %u, \"hash\": %u, \"us\": {",
+            (unsigned long)r->start, r->thread, stats_outcome(r->outcome),
+            r->bytes, r->hash);
+    for (int i = 0, n = 0; i < TRACE_PHASES; ++i)
+        if (r->us[i] != TRACE_UNSET)
+            fprintf(trace_fp, "%s\"%s\": %u", n++ ? ", " : "", phase_names[i],
+                    r->us[i]);
+    fprintf(trace_fp, "}}\n");
+}
@@ -0,0 +1,74 @@
+/*
+ * trace.h - per-request phase latency traces
+ */
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdint.h>
+
+/* Records a thread may have waiting for the drain thread */
+#define TRACE_RING 4096
+
+/* Period of the drain thread, in milliseconds */
+#define TRACE_DRAIN_MS 100
+
+/* A trace file whose name ends with this is written as JSON lines */
+#define TRACE_JSONL ".jsonl"
+
+/* Offset of a phase the request did not go through */
+#define TRACE_UNSET UINT32_MAX
+
+/* Phases of a request, in the order they happen */
+enum
+{
+    TRACE_WORKER,       /* a worker took the connection (threaded engine) */
+    TRACE_PARSED,       /* request head complete */
+    TRACE_LOOKUP,       /* memory and disk cache looked up */
+    TRACE_DNS,          /* end server address known */
+    TRACE_CONNECT,      /* connected, or took a pooled connection */
+    TRACE_SENT,         /* request written to the end server */
+    TRACE_FIRST,        /* first response byte, from the server or a flight */
+    TRACE_DONE,         /* response written to the client */
+    TRACE_PHASES
+};
+
+/*
+ * What a request went through.  start is the monotonic clock when it
+ * began: the accept of its connection for the first request, the arrival
+ * of its first bytes for the next ones.  A binary trace file is a
+ * trace_header followed by these records as they are in memory.
+ */
+typedef struct
+{
+    uint64_t start;                 /* nanoseconds */
+    uint32_t us[TRACE_PHASES];      /* microseconds from start to a phase */
+    uint32_t bytes;                 /* of the object sent from */
+    uint32_t hash;                  /* cache_hash() of the url */
+    uint16_t thread;                /* which thread served it */
+    uint8_t outcome;                /* STATS_* */
+    uint8_t live;                   /* being recorded, 0 in the file */
+} trace_record;
+
+#define TRACE_MAGIC "PXYTRACE"
+#define TRACE_VERSION 1
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;           /* sizeof(trace_record) */
+    int64_t realtime;               /* clocks when the file was started, */
+    int64_t monotonic;              /* to date the records, nanoseconds */
+} trace_header;
+
+int trace_init(char *path, int every);
+void trace_accept(int fd);
+long trace_accepted(int fd);
+void trace_begin(trace_record *r, long start);
+void trace_use(trace_record *r);
+void trace_mark(int phase);
+void trace_mark_at(int phase, long when);
+void trace_end(int outcome, long bytes, const char *url);
+void trace_flush(void);
+
+#endif /* __TRACE_H__ */
@@ -0,0 +1,92 @@
+/*
+ * tunnel.c - moving CONNECT tunnel bytes between sockets
+ *
+ * Tunneled bytes are never looked at, so they are moved with splice():
+ * from the source socket into a pipe and from the pipe into the
+ * destination socket, without ever being copied to user space.  Where
+ * splice is not supported for the descriptors, the event loops fall back
+ * to their plain read/write copy.
+ *
+ * This file does not include csapp.h, whose declarations clash with the
+ * _GNU_SOURCE ones that splice needs.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "tunnel.h"
+
+/* Open the non-blocking pipe of one direction, -1 on error */
+int tpipe_open(tunnel_pipe *p)
+{
+    p->len = 0;
+    p->used = 0;
+    if (pipe2(p->fds, O_NONBLOCK | O_CLOEXEC) < 0)
+    {
+        p->fds[0] = p->fds[1] = -1;
+        return -1;
+    }
+    return 0;
+}
+
+void tpipe_close(tunnel_pipe *p)
+{
+    if (p->fds[0] >= 0)
+    {
+        close(p->fds[0]);
+        close(p->fds[1]);
+    }
+    p->fds[0] = p->fds[1] = -1;
+    p->len = 0;
+}
+
+/*
+ * Move bytes from srcfd to dstfd through p until one side would block,
+ * with non-blocking descriptors; once srcfd reaches EOF and p drains,
+ * pass the half-close on to dstfd.  Returns -1 on error and
+ * TUNNEL_UNSUPPORTED if splice does not work for srcfd at all.
+ */
+int tpipe_pump(int srcfd, int dstfd, tunnel_pipe *p, int *eof)
+{
+    int flags = SPLICE_F_MOVE | SPLICE_F_NONBLOCK;
+
+    while (1)
+    {
+        while (p->len > 0)
+        {
+            ssize_t n = splice(p->fds[0], NULL, dstfd, NULL, p->len, flags);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return 0;
+                return -1;
+            }
+            p->len -= n;
+        }
+        if (*eof)
+            return 0;
+
+        ssize_t n = splice(srcfd, NULL, p->fds[1], NULL, TUNNEL_PIPE, flags);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (!p->used && (errno == EINVAL || errno == ENOSYS))
+                return TUNNEL_UNSUPPORTED;
+            return -1;
+        }
+        if (n == 0)
+        {
+            *eof = 1;
+            shutdown(dstfd, SHUT_WR);
+            return 0;
+        }
+        p->len += n;
+        p->used = 1;
+    }
+}
@@ -0,0 +1,24 @@
+/*
+ * tunnel.h - moving CONNECT tunnel bytes between sockets
+ */
+#ifndef __TUNNEL_H__
+#define __TUNNEL_H__
+
+#include <stddef.h>
+
+#define TUNNEL_PIPE 65536       /* bytes moved by one splice */
+#define TUNNEL_UNSUPPORTED -2   /* splice cannot move these descriptors */
+
+/* A kernel pipe holding the bytes of one direction */
+typedef struct
+{
+    int fds[2];                 /* -1 if not open */
+    size_t len;                 /* bytes sitting in the pipe */
+    int used;                   /* splice worked at least once */
+} tunnel_pipe;
+
+int tpipe_open(tunnel_pipe *p);
+void tpipe_close(tunnel_pipe *p);
+int tpipe_pump(int srcfd, int dstfd, tunnel_pipe *p, int *eof);
+
+#endif /* __TUNNEL_H__ */
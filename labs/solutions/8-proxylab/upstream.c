@@ -0,0 +1,196 @@
+/*
+ * upstream.c - pool of idle keep-alive connections to end servers
+ *
+ * Every (host, port) the proxy talks to has a small stack of idle
+ * connections, most recently used on top.  A miss takes a connection
+ * from the pool before opening a new one and puts it back once the
+ * response has been read completely and the server agreed to keep the
+ * connection open.
+ *
+ * A connection is checked before it is handed out: it must not have
+ * become readable, since an idle server connection only becomes readable
+ * when the server closes it.  Connections idle for longer than
+ * UPSTREAM_IDLE_TIMEOUT seconds are closed by a reaper thread.
+ */
+#include "csapp.h"
+#include "proxy.h"
+#include "upstream.h"
+#include <poll.h>
+
+#define UPSTREAM_BUCKETS 256    /* hash buckets of (host, port) entries */
+#define UPSTREAM_REAP 1         /* seconds between two sweeps */
+
+typedef struct
+{
+    int fd;
+    time_t since;               /* when it became idle */
+} idle_conn;
+
+typedef struct upstream_host
+{
+    struct upstream_host *next; /* next entry in the same bucket */
+    char *key;                  /* "host:port" */
+    int nidle;
+    idle_conn *idle;            /* max_idle slots, top at idle[nidle - 1] */
+} upstream_host;
+
+static upstream_host *buckets[UPSTREAM_BUCKETS];
+static sem_t pool_mutex;        /* Protection for all entries */
+static int max_idle;
+
+static upstream_host *host_of(char *hostname, char *port, int create);
+static int alive(int fd);
+static void *reaper(void *vargp);
+
+/* init the pool to keep at most n idle connections per (host, port) */
+void upstream_init(int n)
+{
+    pthread_t tid;
+
+    max_idle = n;
+    Sem_init(&pool_mutex, 0, 1);
+    if (max_idle > 0)
+        Pthread_create(&tid, NULL, reaper, NULL);
+}
+
+/* Find (or create) the entry of hostname:port, with pool_mutex held */
+static upstream_host *host_of(char *hostname, char *port, int create)
+{
+    char key[MAXLINE];
+    unsigned int h = 2166136261u;
+
+    snprintf(key, MAXLINE, "%s:%s", hostname, port);
+    for (char *p = key; *p; ++p)
+    {
+        h ^= (unsigned char)*p;
+        h *= 16777619u;
+    }
+
+    upstream_host **bucket = &buckets[h % UPSTREAM_BUCKETS];
+    for (upstream_host *hp = *bucket; hp; hp = hp->next)
+    {
+        if (!strcmp(hp->key, key))
+            return hp;
+    }
+    if (!create)
+        return NULL;
+
+    upstream_host *hp = malloc(sizeof(upstream_host));
+    if (!hp)
+        return NULL;
+    hp->key = strdup(key);
+    hp->idle = calloc(max_idle, sizeof(idle_conn));
+    if (!hp->key || !hp->idle)
+    {
+        free(hp->key);
+        free(hp->idle);
+        free(hp);
+        return NULL;
+    }
+    hp->nidle = 0;
+    hp->next = *bucket;
+    *bucket = hp;
+    return hp;
+}
+
+/* An idle connection is healthy while it has nothing to read */
+static int alive(int fd)
+{
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    return poll(&pfd, 1, 0) == 0;
+}
+
+/*
+ * Take an idle connection to hostname:port out of the pool,
+ * return -1 if there is none
+ */
+int upstream_take(char *hostname, char *port)
+{
+    int fd = -1;
+    time_t now = time(NULL);
+
+    if (max_idle <= 0)
+        return -1;
+
+    P(&pool_mutex);
+    upstream_host *hp = host_of(hostname, port, 0);
+    while (hp && hp->nidle > 0 && fd < 0)
+    {
+        idle_conn *ic = &hp->idle[--hp->nidle];
+        if (now - ic->since < UPSTREAM_IDLE_TIMEOUT && alive(ic->fd))
+            fd = ic->fd;
+        else
+            close(ic->fd);
+    }
+    V(&pool_mutex);
+
+    dbg_printf("upstream %s:%s %s\n", hostname, port,
+               fd < 0 ? "new" : "reused");
+    return fd;
+}
+
+/* Give a connection whose response is complete back to the pool */
+void upstream_put(char *hostname, char *port, int fd)
+{
+    if (max_idle <= 0)
+    {
+        close(fd);
+        return;
+    }
+
+    P(&pool_mutex);
+    upstream_host *hp = host_of(hostname, port, 1);
+    if (!hp)
+    {
+        V(&pool_mutex);
+        close(fd);
+        return;
+    }
+
+    /* Full: the oldest idle connection makes room */
+    if (hp->nidle == max_idle)
+    {
+        close(hp->idle[0].fd);
+        memmove(hp->idle, hp->idle + 1, (max_idle - 1) * sizeof(idle_conn));
+        hp->nidle--;
+    }
+    hp->idle[hp->nidle].fd = fd;
+    hp->idle[hp->nidle].since = time(NULL);
+    hp->nidle++;
+    V(&pool_mutex);
+}
+
+/* Close idle connections that timed out or were closed by the server */
+static void *reaper(void *vargp)
+{
+    Pthread_detach(pthread_self());
+    while (1)
+    {
+        Sleep(UPSTREAM_REAP);
+        time_t now = time(NULL);
+
+        P(&pool_mutex);
+        for (int b = 0; b < UPSTREAM_BUCKETS; ++b)
+        {
+            for (upstream_host *hp = buckets[b]; hp; hp = hp->next)
+            {
+                int kept = 0;
+                for (int i = 0; i < hp->nidle; ++i)
+                {
+                    idle_conn *ic = &hp->idle[i];
+                    if (now - ic->since < UPSTREAM_IDLE_TIMEOUT &&
+                        alive(ic->fd))
+                        hp->idle[kept++] = *ic;
+                    else
+                        close(ic->fd);
+                }
+                hp->nidle = kept;
+            }
+        }
+        V(&pool_mutex);
+    }
+    return NULL;
+}
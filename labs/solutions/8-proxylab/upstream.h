@@ -0,0 +1,17 @@
+/*
+ * upstream.h - pool of idle keep-alive connections to end servers
+ */
+#ifndef __UPSTREAM_H__
+#define __UPSTREAM_H__
+
+/* Default number of idle connections kept per (host, port) */
+#define DEFAULT_UPSTREAM_IDLE 8
+
+/* Seconds an idle connection may wait for its next request */
+#define UPSTREAM_IDLE_TIMEOUT 30
+
+void upstream_init(int max_idle);
+int upstream_take(char *hostname, char *port);
+void upstream_put(char *hostname, char *port, int fd);
+
+#endif /* __UPSTREAM_H__ */